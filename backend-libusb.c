@@ -0,0 +1,317 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <poll.h>
+#include <libubox/list.h>
+#include "switch.h"
+
+struct usb_pollfd {
+	struct list_head list;
+	struct uloop_fd fd;
+	struct usbmode_ctx *ctx;
+};
+
+static void usb_close(struct usbdev_data *data)
+{
+	if (data->devh)
+		libusb_close(data->devh);
+
+	data->devh = NULL;
+}
+
+static int usb_reopen(struct usbdev_data *data)
+{
+	data->devh = libusb_open_device_with_vid_pid(data->ctx->usb,
+		data->desc.idVendor, data->desc.idProduct);
+
+	return data->devh ? 0 : LIBUSB_ERROR_NO_DEVICE;
+}
+
+static int usb_get_string(struct usbdev_data *data, int idx, char *buf, int len)
+{
+	return libusb_get_string_descriptor_ascii(data->devh, idx, (void *) buf, len);
+}
+
+/* same format as the sysfs device name, e.g. 1-1.2 */
+static int usb_get_port_path(struct usbdev_data *data, char *buf, int len)
+{
+	uint8_t ports[8];
+	int i, n, ofs;
+
+	n = libusb_get_port_numbers(data->dev, ports, sizeof(ports));
+	if (n <= 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	ofs = snprintf(buf, len, "%d-%d", libusb_get_bus_number(data->dev), ports[0]);
+	for (i = 1; i < n && ofs < len; i++)
+		ofs += snprintf(buf + ofs, len - ofs, ".%d", ports[i]);
+
+	return ofs < len ? 0 : LIBUSB_ERROR_OVERFLOW;
+}
+
+static int usb_get_config_descriptor(struct usbdev_data *data, int idx,
+				     struct libusb_config_descriptor **config)
+{
+	return libusb_get_config_descriptor(data->dev, idx, config);
+}
+
+static int usb_claim_interface(struct usbdev_data *data, int iface)
+{
+	return libusb_claim_interface(data->devh, iface);
+}
+
+static int usb_release_interface(struct usbdev_data *data, int iface)
+{
+	return libusb_release_interface(data->devh, iface);
+}
+
+static int usb_detach_kernel_driver(struct usbdev_data *data, int iface)
+{
+	return libusb_detach_kernel_driver(data->devh, iface);
+}
+
+static int usb_clear_halt(struct usbdev_data *data, int ep)
+{
+	return libusb_clear_halt(data->devh, ep);
+}
+
+static int usb_get_configuration(struct usbdev_data *data, int *config)
+{
+	return libusb_get_configuration(data->devh, config);
+}
+
+static int usb_set_configuration(struct usbdev_data *data, int config)
+{
+	return libusb_set_configuration(data->devh, config);
+}
+
+static int usb_set_alt_setting(struct usbdev_data *data, int iface, int alt)
+{
+	return libusb_set_interface_alt_setting(data->devh, iface, alt);
+}
+
+static int usb_control_transfer(struct usbdev_data *data, uint8_t type, uint8_t req,
+				uint16_t val, uint16_t idx, unsigned char *buf,
+				uint16_t len, unsigned int timeout)
+{
+	return libusb_control_transfer(data->devh, type, req, val, idx, buf, len, timeout);
+}
+
+static int usb_bulk_transfer(struct usbdev_data *data, int ep, unsigned char *buf,
+			     int len, int *transferred, unsigned int timeout)
+{
+	return libusb_bulk_transfer(data->devh, ep, buf, len, transferred, timeout);
+}
+
+static void usb_transfer_cb(struct libusb_transfer *t)
+{
+	struct usbdev_xfer *xfer = t->user_data;
+
+	xfer->actual = t->actual_length;
+	switch (t->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		xfer->status = 0;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		xfer->status = LIBUSB_ERROR_INTERRUPTED;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		xfer->status = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		xfer->status = LIBUSB_ERROR_PIPE;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		xfer->status = LIBUSB_ERROR_OVERFLOW;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		xfer->status = LIBUSB_ERROR_TIMEOUT;
+		break;
+	default:
+		xfer->status = LIBUSB_ERROR_IO;
+		break;
+	}
+
+	xfer->cb(xfer);
+}
+
+static int usb_submit_interrupt(struct usbdev_xfer *xfer)
+{
+	struct libusb_transfer *t = xfer->priv;
+
+	if (!t) {
+		t = libusb_alloc_transfer(0);
+		if (!t)
+			return LIBUSB_ERROR_NO_MEM;
+
+		xfer->priv = t;
+	}
+
+	libusb_fill_interrupt_transfer(t, xfer->data->devh, xfer->ep, xfer->buf,
+				       xfer->len, usb_transfer_cb, xfer, 0);
+	return libusb_submit_transfer(t);
+}
+
+static void usb_cancel_transfer(struct usbdev_xfer *xfer)
+{
+	if (xfer->priv)
+		libusb_cancel_transfer(xfer->priv);
+}
+
+static void usb_free_transfer(struct usbdev_xfer *xfer)
+{
+	libusb_free_transfer(xfer->priv);
+	xfer->priv = NULL;
+}
+
+static int usb_reset(struct usbdev_data *data)
+{
+	return libusb_reset_device(data->devh);
+}
+
+static bool same_port(libusb_device *dev, libusb_device *old)
+{
+	uint8_t path[8], cur[8];
+	int path_len, len;
+
+	if (libusb_get_bus_number(dev) != libusb_get_bus_number(old))
+		return false;
+
+	path_len = libusb_get_port_numbers(old, path, sizeof(path));
+	len = libusb_get_port_numbers(dev, cur, sizeof(cur));
+	return len >= 0 && len == path_len && !memcmp(cur, path, len);
+}
+
+static int usb_find_reenumerated(struct usbdev_data *data, uint16_t *vid, uint16_t *pid)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	int i, n, ret = LIBUSB_ERROR_NOT_FOUND;
+
+	n = libusb_get_device_list(data->ctx->usb, &list);
+	for (i = 0; i < n; i++) {
+		if (libusb_get_device_address(list[i]) ==
+		    libusb_get_device_address(data->dev))
+			continue;
+
+		if (!same_port(list[i], data->dev))
+			continue;
+
+		ret = libusb_get_device_descriptor(list[i], &desc);
+		if (ret)
+			break;
+
+		*vid = desc.idVendor;
+		*pid = desc.idProduct;
+		break;
+	}
+
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+
+	return ret;
+}
+
+const struct usbdev_ops usbmode_libusb_ops = {
+	.close = usb_close,
+	.reopen = usb_reopen,
+	.get_string = usb_get_string,
+	.get_port_path = usb_get_port_path,
+	.get_config_descriptor = usb_get_config_descriptor,
+	.free_config_descriptor = libusb_free_config_descriptor,
+	.claim_interface = usb_claim_interface,
+	.release_interface = usb_release_interface,
+	.detach_kernel_driver = usb_detach_kernel_driver,
+	.clear_halt = usb_clear_halt,
+	.get_configuration = usb_get_configuration,
+	.set_configuration = usb_set_configuration,
+	.set_alt_setting = usb_set_alt_setting,
+	.control_transfer = usb_control_transfer,
+	.bulk_transfer = usb_bulk_transfer,
+	.submit_interrupt = usb_submit_interrupt,
+	.cancel_transfer = usb_cancel_transfer,
+	.free_transfer = usb_free_transfer,
+	.reset = usb_reset,
+	.find_reenumerated = usb_find_reenumerated,
+};
+
+static void usb_pollfd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct usb_pollfd *pfd = container_of(fd, struct usb_pollfd, fd);
+	struct timeval tv = {};
+
+	libusb_handle_events_timeout_completed(pfd->ctx->usb, &tv, NULL);
+}
+
+static void usb_pollfd_added(int fd, short events, void *user_data)
+{
+	struct usbmode_ctx *ctx = user_data;
+	struct usb_pollfd *pfd;
+	unsigned int flags = 0;
+
+	pfd = calloc(1, sizeof(*pfd));
+	if (!pfd)
+		return;
+
+	if (events & POLLIN)
+		flags |= ULOOP_READ;
+	if (events & POLLOUT)
+		flags |= ULOOP_WRITE;
+
+	pfd->ctx = ctx;
+	pfd->fd.fd = fd;
+	pfd->fd.cb = usb_pollfd_cb;
+	uloop_fd_add(&pfd->fd, flags);
+	list_add_tail(&pfd->list, &ctx->pollfds);
+}
+
+static void usb_pollfd_removed(int fd, void *user_data)
+{
+	struct usbmode_ctx *ctx = user_data;
+	struct usb_pollfd *pfd, *tmp;
+
+	list_for_each_entry_safe(pfd, tmp, &ctx->pollfds, list) {
+		if (pfd->fd.fd != fd)
+			continue;
+
+		uloop_fd_delete(&pfd->fd);
+		list_del(&pfd->list);
+		free(pfd);
+	}
+}
+
+/*
+ * Let the uloop dispatch libusb events, so that asynchronous transfers
+ * complete while other devices wait for their timers. Transfers are
+ * submitted without a timeout, which leaves the libusb file descriptors
+ * as the only event source.
+ */
+int usbmode_uloop_attach(struct usbmode_ctx *ctx)
+{
+	const struct libusb_pollfd **fds;
+	int i;
+
+	fds = libusb_get_pollfds(ctx->usb);
+	if (!fds)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	INIT_LIST_HEAD(&ctx->pollfds);
+	for (i = 0; fds[i]; i++)
+		usb_pollfd_added(fds[i]->fd, fds[i]->events, ctx);
+	libusb_free_pollfds(fds);
+
+	libusb_set_pollfd_notifiers(ctx->usb, usb_pollfd_added, usb_pollfd_removed, ctx);
+	ctx->polled = true;
+	return 0;
+}
+
+void usbmode_uloop_detach(struct usbmode_ctx *ctx)
+{
+	struct usb_pollfd *pfd, *tmp;
+
+	ctx->polled = false;
+	libusb_set_pollfd_notifiers(ctx->usb, NULL, NULL, NULL);
+	list_for_each_entry_safe(pfd, tmp, &ctx->pollfds, list) {
+		uloop_fd_delete(&pfd->fd);
+		list_del(&pfd->list);
+		free(pfd);
+	}
+}
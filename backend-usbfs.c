@@ -0,0 +1,689 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Direct usbfs backend: talks to a single /dev/bus/usb/BBB/DDD node through
+ * the USBDEVFS_* ioctls, without initializing libusb or scanning the bus.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/usbdevice_fs.h>
+
+#include "switch.h"
+
+#define SYSFS_USB_DEVICES	"/sys/bus/usb/devices"
+#define USBFS_MAX_DESC		65536
+
+struct usbfs_priv {
+	int fd;
+	struct uloop_fd ufd;
+	int n_urbs;
+
+	int busnum;
+	int devnum;
+	char sysname[32];
+
+	int desc_len;
+	unsigned char desc[];
+};
+
+static inline struct usbfs_priv *usbfs_priv(struct usbdev_data *data)
+{
+	return data->priv;
+}
+
+static int usbfs_error(int err)
+{
+	switch (err) {
+	case ENOENT:
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case EACCES:
+	case EPERM:
+		return LIBUSB_ERROR_ACCESS;
+	case EBUSY:
+		return LIBUSB_ERROR_BUSY;
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case EINVAL:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	case ENODATA:
+		return LIBUSB_ERROR_NOT_FOUND;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int usbfs_ioctl(struct usbdev_data *data, unsigned long req, void *arg)
+{
+	int ret;
+
+	ret = ioctl(usbfs_priv(data)->fd, req, arg);
+	if (ret < 0)
+		return usbfs_error(errno);
+
+	return ret;
+}
+
+static int sysfs_read(const char *sysname, const char *attr, char *buf, int len)
+{
+	char path[128];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), SYSFS_USB_DEVICES "/%s/%s", sysname, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret <= 0)
+		return -1;
+
+	buf[ret] = 0;
+	return 0;
+}
+
+static int sysfs_read_int(const char *sysname, const char *attr, int base)
+{
+	char buf[16], *end;
+	long val;
+
+	if (sysfs_read(sysname, attr, buf, sizeof(buf)))
+		return -1;
+
+	val = strtol(buf, &end, base);
+	if (end == buf)
+		return -1;
+
+	return val;
+}
+
+/*
+ * Find the port based sysfs name (e.g. 1-1.2) of the device, which is the
+ * last component of the link behind its char device.
+ */
+static int sysfs_find(struct usbfs_priv *priv)
+{
+	char path[64], link[256];
+	struct stat st;
+	char *name;
+	ssize_t len;
+
+	if (fstat(priv->fd, &st))
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u",
+		 major(st.st_rdev), minor(st.st_rdev));
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0)
+		return -1;
+
+	link[len] = 0;
+	name = strrchr(link, '/');
+	name = name ? name + 1 : link;
+	if (strlen(name) >= sizeof(priv->sysname))
+		return -1;
+
+	strcpy(priv->sysname, name);
+	return 0;
+}
+
+static int usbfs_open_node(struct usbfs_priv *priv)
+{
+	char path[32];
+
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", priv->busnum, priv->devnum);
+	priv->fd = open(path, O_RDWR | O_CLOEXEC);
+
+	return priv->fd < 0 ? usbfs_error(errno) : 0;
+}
+
+static void usbfs_close(struct usbdev_data *data)
+{
+	struct usbfs_priv *priv = usbfs_priv(data);
+
+	if (priv->ufd.registered)
+		uloop_fd_delete(&priv->ufd);
+
+	if (priv->fd >= 0)
+		close(priv->fd);
+
+	priv->fd = -1;
+}
+
+static int usbfs_reopen(struct usbdev_data *data)
+{
+	struct usbfs_priv *priv = usbfs_priv(data);
+	int devnum;
+
+	devnum = sysfs_read_int(priv->sysname, "devnum", 10);
+	if (devnum < 0)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	priv->devnum = devnum;
+	return usbfs_open_node(priv);
+}
+
+static int usbfs_control_transfer(struct usbdev_data *data, uint8_t type, uint8_t req,
+				  uint16_t val, uint16_t idx, unsigned char *buf,
+				  uint16_t len, unsigned int timeout)
+{
+	struct usbdevfs_ctrltransfer ctrl = {
+		.bRequestType = type,
+		.bRequest = req,
+		.wValue = val,
+		.wIndex = idx,
+		.wLength = len,
+		.timeout = timeout,
+		.data = buf,
+	};
+
+	return usbfs_ioctl(data, USBDEVFS_CONTROL, &ctrl);
+}
+
+static int usbfs_bulk_transfer(struct usbdev_data *data, int ep, unsigned char *buf,
+			       int len, int *transferred, unsigned int timeout)
+{
+	struct usbdevfs_bulktransfer bulk = {
+		.ep = ep,
+		.len = len,
+		.timeout = timeout,
+		.data = buf,
+	};
+	int ret;
+
+	*transferred = 0;
+	ret = usbfs_ioctl(data, USBDEVFS_BULK, &bulk);
+	if (ret < 0)
+		return ret;
+
+	*transferred = ret;
+	return 0;
+}
+
+static int usbfs_urb_status(int status)
+{
+	switch (status) {
+	case 0:
+		return 0;
+	case -ENOENT:
+	case -ECONNRESET:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return usbfs_error(-status);
+	}
+}
+
+/*
+ * The node polls writable while completed URBs are waiting to be reaped.
+ * A completion callback may finish the switch and free the device once
+ * its last URB is reaped, so stop touching it after that one.
+ */
+static void usbfs_urb_cb(struct uloop_fd *ufd, unsigned int events)
+{
+	struct usbfs_priv *priv = container_of(ufd, struct usbfs_priv, ufd);
+	struct usbdevfs_urb *urb;
+	struct usbdev_xfer *xfer;
+	bool last;
+
+	while (!ioctl(ufd->fd, USBDEVFS_REAPURBNDELAY, &urb)) {
+		xfer = urb->usercontext;
+		xfer->status = usbfs_urb_status(urb->status);
+		xfer->actual = urb->actual_length;
+
+		last = !--priv->n_urbs;
+		if (last)
+			uloop_fd_delete(ufd);
+
+		xfer->cb(xfer);
+		if (last)
+			return;
+	}
+
+	if (errno != EAGAIN)
+		uloop_fd_delete(ufd);
+}
+
+static int usbfs_submit_interrupt(struct usbdev_xfer *xfer)
+{
+	struct usbfs_priv *priv = usbfs_priv(xfer->data);
+	struct usbdevfs_urb *urb = xfer->priv;
+	int ret;
+
+	if (!urb) {
+		urb = calloc(1, sizeof(*urb));
+		if (!urb)
+			return LIBUSB_ERROR_NO_MEM;
+
+		xfer->priv = urb;
+	}
+
+	memset(urb, 0, sizeof(*urb));
+	urb->type = USBDEVFS_URB_TYPE_INTERRUPT;
+	urb->endpoint = xfer->ep;
+	urb->buffer = xfer->buf;
+	urb->buffer_length = xfer->len;
+	urb->usercontext = xfer;
+
+	ret = usbfs_ioctl(xfer->data, USBDEVFS_SUBMITURB, urb);
+	if (ret < 0)
+		return ret;
+
+	if (!priv->n_urbs++) {
+		priv->ufd.fd = priv->fd;
+		priv->ufd.cb = usbfs_urb_cb;
+		uloop_fd_add(&priv->ufd, ULOOP_WRITE);
+	}
+
+	return 0;
+}
+
+/* the discarded URB still completes and is reaped like any other */
+static void usbfs_cancel_transfer(struct usbdev_xfer *xfer)
+{
+	if (xfer->priv)
+		ioctl(usbfs_priv(xfer->data)->fd, USBDEVFS_DISCARDURB, xfer->priv);
+}
+
+static void usbfs_free_transfer(struct usbdev_xfer *xfer)
+{
+	free(xfer->priv);
+	xfer->priv = NULL;
+}
+
+static int usbfs_get_port_path(struct usbdev_data *data, char *buf, int len)
+{
+	struct usbfs_priv *priv = usbfs_priv(data);
+
+	if (!priv->sysname[0])
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	snprintf(buf, len, "%s", priv->sysname);
+	return 0;
+}
+
+static int usbfs_get_string(struct usbdev_data *data, int idx, char *buf, int len)
+{
+	unsigned char tbuf[255];
+	int ret, langid, i, di;
+
+	if (!idx)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ret = usbfs_control_transfer(data, LIBUSB_ENDPOINT_IN,
+				     LIBUSB_REQUEST_GET_DESCRIPTOR,
+				     LIBUSB_DT_STRING << 8, 0, tbuf, sizeof(tbuf), 1000);
+	if (ret < 0)
+		return ret;
+
+	if (ret < 4)
+		return LIBUSB_ERROR_IO;
+
+	langid = tbuf[2] | (tbuf[3] << 8);
+	ret = usbfs_control_transfer(data, LIBUSB_ENDPOINT_IN,
+				     LIBUSB_REQUEST_GET_DESCRIPTOR,
+				     (LIBUSB_DT_STRING << 8) | idx, langid,
+				     tbuf, sizeof(tbuf), 1000);
+	if (ret < 0)
+		return ret;
+
+	if (ret < 2 || tbuf[1] != LIBUSB_DT_STRING || tbuf[0] > ret)
+		return LIBUSB_ERROR_IO;
+
+	for (di = 0, i = 2; i + 1 < tbuf[0] && di < len - 1; i += 2)
+		buf[di++] = tbuf[i + 1] ? '?' : tbuf[i];
+	buf[di] = 0;
+
+	return di;
+}
+
+static uint16_t get_le16(const unsigned char *buf)
+{
+	return buf[0] | (buf[1] << 8);
+}
+
+/*
+ * Parse a raw configuration descriptor into the libusb representation.
+ * Everything is allocated in one block, so it is released with free().
+ */
+static int parse_config_desc(const unsigned char *buf, int len,
+			     struct libusb_config_descriptor **config_ret)
+{
+	struct libusb_config_descriptor *config;
+	struct libusb_interface *ifaces, *iface = NULL;
+	struct libusb_interface_descriptor *alts, *alt = NULL;
+	struct libusb_endpoint_descriptor *eps, *ep;
+	int n_ifaces, n_alts = 0, n_eps = 0;
+	int pos;
+
+	if (len < 9 || buf[1] != LIBUSB_DT_CONFIG)
+		return LIBUSB_ERROR_IO;
+
+	for (pos = buf[0]; pos + 2 <= len; pos += buf[pos]) {
+		if (buf[pos] < 2 || pos + buf[pos] > len)
+			break;
+
+		if (buf[pos + 1] == LIBUSB_DT_INTERFACE)
+			n_alts++;
+		else if (buf[pos + 1] == LIBUSB_DT_ENDPOINT)
+			n_eps++;
+	}
+
+	n_ifaces = buf[4];
+	config = calloc(1, sizeof(*config) + n_ifaces * sizeof(*ifaces) +
+			n_alts * sizeof(*alts) + n_eps * sizeof(*eps));
+	if (!config)
+		return LIBUSB_ERROR_NO_MEM;
+
+	ifaces = (void *) (config + 1);
+	alts = (void *) (ifaces + n_ifaces);
+	eps = (void *) (alts + n_alts);
+
+	config->bLength = buf[0];
+	config->bDescriptorType = buf[1];
+	config->wTotalLength = get_le16(buf + 2);
+	config->bConfigurationValue = buf[5];
+	config->iConfiguration = buf[6];
+	config->bmAttributes = buf[7];
+	config->MaxPower = buf[8];
+	config->interface = ifaces;
+
+	for (pos = buf[0]; pos + 2 <= len; pos += buf[pos]) {
+		const unsigned char *desc = buf + pos;
+
+		if (desc[0] < 2 || pos + desc[0] > len)
+			break;
+
+		if (desc[1] == LIBUSB_DT_INTERFACE && desc[0] >= 9) {
+			/* alt settings of one interface are contiguous */
+			if (!alt || alt->bInterfaceNumber != desc[2]) {
+				if (config->bNumInterfaces == n_ifaces) {
+					alt = NULL;
+					continue;
+				}
+
+				iface = &ifaces[config->bNumInterfaces++];
+				iface->altsetting = alts;
+			}
+
+			alt = alts++;
+			iface->num_altsetting++;
+			alt->bLength = desc[0];
+			alt->bDescriptorType = desc[1];
+			alt->bInterfaceNumber = desc[2];
+			alt->bAlternateSetting = desc[3];
+			alt->bInterfaceClass = desc[5];
+			alt->bInterfaceSubClass = desc[6];
+			alt->bInterfaceProtocol = desc[7];
+			alt->iInterface = desc[8];
+			alt->endpoint = eps;
+		} else if (desc[1] == LIBUSB_DT_ENDPOINT && desc[0] >= 7 && alt) {
+			ep = eps++;
+			alt->bNumEndpoints++;
+			ep->bLength = desc[0];
+			ep->bDescriptorType = desc[1];
+			ep->bEndpointAddress = desc[2];
+			ep->bmAttributes = desc[3];
+			ep->wMaxPacketSize = get_le16(desc + 4);
+			ep->bInterval = desc[6];
+			if (desc[0] >= 9) {
+				ep->bRefresh = desc[7];
+				ep->bSynchAddress = desc[8];
+			}
+		}
+	}
+
+	*config_ret = config;
+	return 0;
+}
+
+/* look up a raw config descriptor by index */
+static const unsigned char *
+find_config_desc(struct usbfs_priv *priv, int idx, int *len)
+{
+	const unsigned char *buf = priv->desc;
+	int pos = buf[0];
+	int i;
+
+	for (i = 0; pos + 9 <= priv->desc_len; i++) {
+		*len = get_le16(buf + pos + 2);
+		if (*len < 9 || pos + *len > priv->desc_len)
+			break;
+
+		if (i == idx)
+			return buf + pos;
+
+		pos += *len;
+	}
+
+	return NULL;
+}
+
+static int usbfs_get_config_descriptor(struct usbdev_data *data, int idx,
+				       struct libusb_config_descriptor **config)
+{
+	const unsigned char *buf;
+	int len;
+
+	buf = find_config_desc(usbfs_priv(data), idx, &len);
+	if (!buf)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return parse_config_desc(buf, len, config);
+}
+
+static int usbfs_get_configuration(struct usbdev_data *data, int *config)
+{
+	char buf[8];
+
+	if (sysfs_read(usbfs_priv(data)->sysname, "bConfigurationValue", buf, sizeof(buf)))
+		return LIBUSB_ERROR_IO;
+
+	/* empty while unconfigured */
+	*config = atoi(buf);
+	return 0;
+}
+
+static void usbfs_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+	free(config);
+}
+
+static int usbfs_claim_interface(struct usbdev_data *data, int iface)
+{
+	unsigned int val = iface;
+
+	return usbfs_ioctl(data, USBDEVFS_CLAIMINTERFACE, &val);
+}
+
+static int usbfs_release_interface(struct usbdev_data *data, int iface)
+{
+	unsigned int val = iface;
+
+	return usbfs_ioctl(data, USBDEVFS_RELEASEINTERFACE, &val);
+}
+
+static int usbfs_detach_kernel_driver(struct usbdev_data *data, int iface)
+{
+	struct usbdevfs_ioctl cmd = {
+		.ifno = iface,
+		.ioctl_code = USBDEVFS_DISCONNECT,
+	};
+	int ret;
+
+	ret = usbfs_ioctl(data, USBDEVFS_IOCTL, &cmd);
+	return ret < 0 ? ret : 0;
+}
+
+static int usbfs_clear_halt(struct usbdev_data *data, int ep)
+{
+	unsigned int val = ep;
+
+	return usbfs_ioctl(data, USBDEVFS_CLEAR_HALT, &val);
+}
+
+static int usbfs_set_configuration(struct usbdev_data *data, int config)
+{
+	int val = config;
+
+	return usbfs_ioctl(data, USBDEVFS_SETCONFIGURATION, &val);
+}
+
+static int usbfs_set_alt_setting(struct usbdev_data *data, int iface, int alt)
+{
+	struct usbdevfs_setinterface setintf = {
+		.interface = iface,
+		.altsetting = alt,
+	};
+
+	return usbfs_ioctl(data, USBDEVFS_SETINTERFACE, &setintf);
+}
+
+static int usbfs_reset(struct usbdev_data *data)
+{
+	int ret;
+
+	ret = usbfs_ioctl(data, USBDEVFS_RESET, NULL);
+	if (ret == LIBUSB_ERROR_NO_DEVICE)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return ret;
+}
+
+static int usbfs_find_reenumerated(struct usbdev_data *data, uint16_t *vid, uint16_t *pid)
+{
+	struct usbfs_priv *priv = usbfs_priv(data);
+	int devnum, val;
+
+	devnum = sysfs_read_int(priv->sysname, "devnum", 10);
+	if (devnum < 0 || devnum == priv->devnum)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	val = sysfs_read_int(priv->sysname, "idVendor", 16);
+	if (val < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	*vid = val;
+
+	val = sysfs_read_int(priv->sysname, "idProduct", 16);
+	if (val < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	*pid = val;
+
+	return 0;
+}
+
+static const struct usbdev_ops usbfs_ops = {
+	.close = usbfs_close,
+	.reopen = usbfs_reopen,
+	.get_string = usbfs_get_string,
+	.get_port_path = usbfs_get_port_path,
+	.get_config_descriptor = usbfs_get_config_descriptor,
+	.free_config_descriptor = usbfs_free_config_descriptor,
+	.claim_interface = usbfs_claim_interface,
+	.release_interface = usbfs_release_interface,
+	.detach_kernel_driver = usbfs_detach_kernel_driver,
+	.clear_halt = usbfs_clear_halt,
+	.get_configuration = usbfs_get_configuration,
+	.set_configuration = usbfs_set_configuration,
+	.set_alt_setting = usbfs_set_alt_setting,
+	.control_transfer = usbfs_control_transfer,
+	.bulk_transfer = usbfs_bulk_transfer,
+	.submit_interrupt = usbfs_submit_interrupt,
+	.cancel_transfer = usbfs_cancel_transfer,
+	.free_transfer = usbfs_free_transfer,
+	.reset = usbfs_reset,
+	.find_reenumerated = usbfs_find_reenumerated,
+};
+
+static void parse_device_desc(struct libusb_device_descriptor *desc,
+			      const unsigned char *buf)
+{
+	desc->bLength = buf[0];
+	desc->bDescriptorType = buf[1];
+	desc->bcdUSB = get_le16(buf + 2);
+	desc->bDeviceClass = buf[4];
+	desc->bDeviceSubClass = buf[5];
+	desc->bDeviceProtocol = buf[6];
+	desc->bMaxPacketSize0 = buf[7];
+	desc->idVendor = get_le16(buf + 8);
+	desc->idProduct = get_le16(buf + 10);
+	desc->bcdDevice = get_le16(buf + 12);
+	desc->iManufacturer = buf[14];
+	desc->iProduct = buf[15];
+	desc->iSerialNumber = buf[16];
+	desc->bNumConfigurations = buf[17];
+}
+
+/*
+ * Open a device node such as /dev/bus/usb/001/002. Reading the node
+ * returns the cached device and configuration descriptors, no USB
+ * traffic is needed until the switch itself.
+ */
+struct usbdev_data *usbfs_open(struct usbmode_ctx *ctx, const char *path)
+{
+	static unsigned char buf[USBFS_MAX_DESC];
+	struct usbdev_data *data;
+	struct usbfs_priv *priv;
+	int busnum, devnum, fd, len = 0, ret;
+
+	if (sscanf(path, "/dev/bus/usb/%d/%d", &busnum, &devnum) != 2) {
+		fprintf(stderr, "Invalid usbfs device path %s\n", path);
+		return NULL;
+	}
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	while (len < sizeof(buf)) {
+		ret = read(fd, buf + len, sizeof(buf) - len);
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+
+	if (len < LIBUSB_DT_DEVICE_SIZE || buf[1] != LIBUSB_DT_DEVICE) {
+		fprintf(stderr, "Failed to read descriptors from %s\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	data = calloc(1, sizeof(*data));
+	priv = calloc(1, sizeof(*priv) + len);
+	if (!data || !priv) {
+		free(data);
+		free(priv);
+		close(fd);
+		return NULL;
+	}
+
+	priv->fd = fd;
+	priv->busnum = busnum;
+	priv->devnum = devnum;
+	priv->desc_len = len;
+	memcpy(priv->desc, buf, len);
+	if (sysfs_find(priv))
+		fprintf(stderr, "No sysfs entry for %s, reopen and reset tracking unavailable\n", path);
+
+	data->ctx = ctx;
+	data->ops = &usbfs_ops;
+	data->async = true;
+	data->priv = priv;
+	data->claim = CLAIM_NONE;
+	parse_device_desc(&data->desc, buf);
+
+	return data;
+}
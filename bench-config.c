@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Config scalability benchmark
+ *
+ * Generates synthetic configurations in the layout written by
+ * convert-modeswitch.pl and measures, for each size, the cost of loading
+ * them, the resulting peak RSS, device lookups and rule matching.
+ * Every size is measured in a separate child process so that the memory
+ * numbers are not skewed by earlier runs.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <libubox/blobmsg_json.h>
+#include "switch.h"
+
+#define BENCH_KEYS	1024
+#define BENCH_LOOKUPS	1000000
+#define BENCH_MATCHES	1000000
+
+static const int default_sizes[] = { 1000, 10000, 100000 };
+static const char *tmpdir = "/tmp";
+static bool keep;
+static struct blob_buf conf;
+static struct usbmode_ctx ctx;
+
+static volatile uintptr_t sink;
+
+static void dev_id(char *buf, int i)
+{
+	sprintf(buf, "%04x:%04x", 0x1000 + i / 4096, 0x1000 + i % 4096);
+}
+
+static bool dev_multi_rule(int i)
+{
+	return !(i % 4);
+}
+
+static void write_rule(FILE *f, const char *match, int i, int n_msgs, bool last)
+{
+	fprintf(f, "\t\t\t\"%s\": {\n", match);
+	fprintf(f, "\t\t\t\t\"t_vendor\": %d,\n", 0x1000 + i / 4096);
+	fprintf(f, "\t\t\t\t\"t_product\": [ %d, %d ],\n", 0x2000 + i % 4096, 0x3000 + i % 4096);
+	fprintf(f, "\t\t\t\t\"mode\": \"%s\",\n", (i % 3) ? "Generic" : "StandardEject");
+	fprintf(f, "\t\t\t\t\"msg\": [ %d, %d ],\n", i % n_msgs, (i + 1) % n_msgs);
+	fprintf(f, "\t\t\t\t\"response\": true\n");
+	fprintf(f, "\t\t\t}%s\n", last ? "" : ",");
+}
+
+/*
+ * Multi-rule entries list their string matches before the "*" fallback,
+ * which is the order usbmode_find_dev_data() has to walk for a
+ * non-matching device.
+ */
+static int write_config(const char *file, int n_devs)
+{
+	int n_msgs = n_devs / 8 + 1;
+	char id[10], match[32];
+	FILE *f;
+	int i;
+
+	f = fopen(file, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to create %s\n", file);
+		return -1;
+	}
+
+	fprintf(f, "{\n\t\"messages\" : [\n");
+	for (i = 0; i < n_msgs; i++)
+		fprintf(f, "\t\t\"55534243%08x000000000000061e000000000000000000000000000000\"%s\n",
+			i, i < n_msgs - 1 ? "," : "");
+	fprintf(f, "\t],\n\n\t\"devices\" : {\n");
+
+	for (i = 0; i < n_devs; i++) {
+		dev_id(id, i);
+		fprintf(f, "\t\t\"%s\": {\n", id);
+		if (dev_multi_rule(i)) {
+			sprintf(match, "uMa=Vendor%d", i);
+			write_rule(f, match, i, n_msgs, false);
+			sprintf(match, "uPr=Product%d", i);
+			write_rule(f, match, i, n_msgs, false);
+			sprintf(match, "uSe=%08d", i);
+			write_rule(f, match, i, n_msgs, false);
+		}
+		write_rule(f, "*", i, n_msgs, true);
+		fprintf(f, "\t\t}%s\n", i < n_devs - 1 ? "," : "");
+	}
+
+	fprintf(f, "\t}\n}\n");
+
+	if (fclose(f)) {
+		fprintf(stderr, "Failed to write %s\n", file);
+		return -1;
+	}
+
+	return 0;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long rss_kb(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static unsigned int rand_next(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static int run_bench(FILE *out, const char *file, int n_devs)
+{
+	static char keys[BENCH_KEYS][10], miss[BENCH_KEYS][10];
+	static struct device *multi[BENCH_KEYS];
+	struct usbdev_data data = {};
+	unsigned int seed = 1;
+	struct device *dev;
+	double start, load, lookup_hit, lookup_miss, match;
+	long rss_base;
+	int i, n_multi = 0;
+
+	for (i = 0; i < BENCH_KEYS; i++) {
+		dev_id(keys[i], rand_next(&seed) % n_devs);
+		sprintf(miss[i], "%04x:%04x", 0xffff, rand_next(&seed) & 0xffff);
+	}
+
+	rss_base = rss_kb();
+	start = now_ns();
+	usbmode_init_config(&ctx);
+	blob_buf_init(&conf, 0);
+	if (!blobmsg_add_json_from_file(&conf, file) ||
+	    usbmode_parse_config(&ctx, conf.head)) {
+		fprintf(stderr, "Failed to load config file %s\n", file);
+		return -1;
+	}
+	load = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		sink += (uintptr_t) avl_find(&ctx.devices, keys[i % BENCH_KEYS]);
+	lookup_hit = (now_ns() - start) / BENCH_LOOKUPS;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		sink += (uintptr_t) avl_find(&ctx.devices, miss[i % BENCH_KEYS]);
+	lookup_miss = (now_ns() - start) / BENCH_LOOKUPS;
+
+	for (i = 0; i < n_devs && n_multi < BENCH_KEYS; i += 4) {
+		char id[10];
+
+		dev_id(id, i);
+		dev = avl_find_element(&ctx.devices, id, dev, avl);
+		if (dev)
+			multi[n_multi++] = dev;
+	}
+
+	/* strings that match none of the rules, so every lookup hits "*" last */
+	strcpy(data.mfg, "Unknown");
+	strcpy(data.prod, "Unknown");
+	strcpy(data.serial, "0");
+
+	start = now_ns();
+	for (i = 0; i < BENCH_MATCHES; i++)
+		sink += (uintptr_t) usbmode_find_dev_data(&data, multi[i % n_multi]);
+	match = (now_ns() - start) / BENCH_MATCHES;
+
+	fprintf(out, "\t\t{\n"
+		"\t\t\t\"devices\": %d,\n"
+		"\t\t\t\"messages\": %d,\n"
+		"\t\t\t\"blob_bytes\": %zu,\n"
+		"\t\t\t\"load_ms\": %.3f,\n"
+		"\t\t\t\"rss_base_kb\": %ld,\n"
+		"\t\t\t\"peak_rss_kb\": %ld,\n"
+		"\t\t\t\"lookup_hit_ns\": %.1f,\n"
+		"\t\t\t\"lookup_miss_ns\": %.1f,\n"
+		"\t\t\t\"match_ns\": %.1f\n"
+		"\t\t}",
+		n_devs, ctx.n_messages, blob_raw_len(conf.head), load / 1e6,
+		rss_base, rss_kb(), lookup_hit, lookup_miss, match);
+
+	return 0;
+}
+
+static int bench_size(FILE *out, int n_devs, bool first)
+{
+	char file[256], buf[1024];
+	int fds[2], status, len = 0, ret;
+	pid_t pid;
+
+	snprintf(file, sizeof(file), "%s/usbmode-bench-%d.json", tmpdir, n_devs);
+	if (write_config(file, n_devs))
+		return -1;
+
+	if (pipe(fds))
+		return -1;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (!pid) {
+		FILE *f;
+
+		close(fds[0]);
+		f = fdopen(fds[1], "w");
+		ret = run_bench(f, file, n_devs);
+		fclose(f);
+		_exit(ret ? 1 : 0);
+	}
+
+	close(fds[1]);
+	while (len < sizeof(buf) - 1) {
+		ret = read(fds[0], buf + len, sizeof(buf) - 1 - len);
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+	buf[len] = 0;
+	close(fds[0]);
+
+	waitpid(pid, &status, 0);
+	if (!keep)
+		unlink(file);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+
+	fprintf(out, "%s%s", first ? "" : ",\n", buf);
+	return 0;
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s <options> [<entries>...]\n"
+		"Options:\n"
+		"	-o <file>	Write results to <file> (default: stdout)\n"
+		"	-d <dir>	Create config files in <dir> (default: /tmp)\n"
+		"	-k		Keep generated config files\n"
+		"	-g		Only generate config files, do not benchmark\n"
+		"\n"
+		"Default sizes: 1000 10000 100000 device entries\n"
+		"\n", prog);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *outfile = NULL;
+	bool generate = false;
+	FILE *out = stdout;
+	int n_sizes, *sizes;
+	int i, ch;
+
+	while ((ch = getopt(argc, argv, "o:d:kg")) != -1) {
+		switch (ch) {
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'd':
+			tmpdir = optarg;
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'g':
+			generate = true;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	n_sizes = argc - optind;
+	if (n_sizes) {
+		sizes = calloc(n_sizes, sizeof(*sizes));
+		for (i = 0; i < n_sizes; i++) {
+			sizes[i] = atoi(argv[optind + i]);
+			if (sizes[i] <= 0)
+				return usage(argv[0]);
+		}
+	} else {
+		n_sizes = ARRAY_SIZE(default_sizes);
+		sizes = (int *) default_sizes;
+	}
+
+	if (generate) {
+		for (i = 0; i < n_sizes; i++) {
+			char file[256];
+
+			snprintf(file, sizeof(file), "%s/usbmode-bench-%d.json", tmpdir, sizes[i]);
+			if (write_config(file, sizes[i]))
+				return 1;
+
+			fprintf(stderr, "Generated %s\n", file);
+		}
+		return 0;
+	}
+
+	if (outfile) {
+		out = fopen(outfile, "w");
+		if (!out) {
+			fprintf(stderr, "Failed to open %s\n", outfile);
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n\t\"results\": [\n");
+	for (i = 0; i < n_sizes; i++) {
+		if (bench_size(out, sizes[i], !i)) {
+			fprintf(stderr, "Benchmark failed for %d entries\n", sizes[i]);
+			return 1;
+		}
+	}
+	fprintf(out, "\n\t]\n}\n");
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Device claims shared between concurrently running instances (e.g. a
+ * hotplug triggered run next to a coldplug one), so that only one of them
+ * switches a given device.
+ *
+ * The table lives in a shared memory object. Every slot holds the port path
+ * of the claimed device and the owner pid. Claims are looked up and taken
+ * under a table wide lock, starting at the slot the path hashes to and
+ * probing linearly from there. Claims of exited owners, or ones older than
+ * CLAIM_MAX_AGE, are considered stale and taken over. Releasing a claim
+ * only clears the owner of its slot and does not need the lock.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "switch.h"
+
+#define CLAIM_SHM	"/usbmode-claims"
+#define CLAIM_SLOTS	256
+#define CLAIM_MAX_AGE	120
+#define CLAIM_PATH_LEN	32
+
+struct claim_slot {
+	uint32_t owner;
+	uint32_t time;
+	char path[CLAIM_PATH_LEN];
+};
+
+struct claim_table {
+	uint32_t lock;
+	struct claim_slot slot[CLAIM_SLOTS];
+};
+
+static struct claim_table *table;
+
+static uint32_t claim_hash(const char *path)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*path) {
+		hash ^= (unsigned char) *path++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static uint32_t claim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static bool claim_dead(uint32_t pid)
+{
+	return kill(pid, 0) && errno == ESRCH;
+}
+
+static void claim_lock(void)
+{
+	uint32_t pid = getpid();
+	uint32_t cur;
+
+	for (;;) {
+		cur = 0;
+		if (__atomic_compare_exchange_n(&table->lock, &cur, pid, false,
+						__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return;
+
+		/* take over from a holder that died in the middle */
+		if (claim_dead(cur) &&
+		    __atomic_compare_exchange_n(&table->lock, &cur, pid, false,
+						__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return;
+
+		sched_yield();
+	}
+}
+
+static void claim_unlock(void)
+{
+	__atomic_store_n(&table->lock, 0, __ATOMIC_SEQ_CST);
+}
+
+static bool claim_stale(struct claim_slot *s, uint32_t owner)
+{
+	return claim_dead(owner) || claim_now() - s->time > CLAIM_MAX_AGE;
+}
+
+int usbmode_claim_init(void)
+{
+	void *ptr;
+	int fd;
+
+	if (table)
+		return 0;
+
+	fd = shm_open(CLAIM_SHM, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, sizeof(*table))) {
+		close(fd);
+		return -1;
+	}
+
+	ptr = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return -1;
+
+	table = ptr;
+	return 0;
+}
+
+/*
+ * Claim the device at the given port path (e.g. 1-1.2). Returns the slot
+ * on success, CLAIM_BUSY if another live instance holds the device, or
+ * CLAIM_NONE if claims are unavailable or the table is full, in which case
+ * the device is handled unclaimed as before.
+ */
+int usbmode_claim_device(const char *path)
+{
+	int home, slot, free_slot = CLAIM_NONE;
+	struct claim_slot *s;
+	uint32_t owner;
+	int i;
+
+	if (!table || strlen(path) >= CLAIM_PATH_LEN)
+		return CLAIM_NONE;
+
+	home = claim_hash(path) % CLAIM_SLOTS;
+
+	claim_lock();
+	for (i = 0; i < CLAIM_SLOTS; i++) {
+		slot = (home + i) % CLAIM_SLOTS;
+		s = &table->slot[slot];
+
+		owner = __atomic_load_n(&s->owner, __ATOMIC_SEQ_CST);
+		if (owner && claim_stale(s, owner))
+			owner = 0;
+
+		if (!owner) {
+			if (free_slot < 0)
+				free_slot = slot;
+			continue;
+		}
+
+		if (!strcmp(s->path, path)) {
+			claim_unlock();
+			return CLAIM_BUSY;
+		}
+	}
+
+	if (free_slot >= 0) {
+		s = &table->slot[free_slot];
+		strcpy(s->path, path);
+		s->time = claim_now();
+		__atomic_store_n(&s->owner, getpid(), __ATOMIC_SEQ_CST);
+	}
+	claim_unlock();
+
+	return free_slot;
+}
+
+void usbmode_claim_release(int slot)
+{
+	uint32_t cur = getpid();
+
+	if (slot < 0)
+		return;
+
+	/* leave the slot alone if a stale check has taken it over meanwhile */
+	__atomic_compare_exchange_n(&table->slot[slot].owner, &cur, 0, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
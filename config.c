@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <stdio.h>
+#include <ctype.h>
+
+#include <libubox/avl-cmp.h>
+#include "switch.h"
+
+void usbmode_init_config(struct usbmode_ctx *ctx)
+{
+	avl_init(&ctx->devices, avl_strcmp, false, NULL);
+}
+
+static int hex2num(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+
+	c = toupper(c);
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+static int hex2byte(const char *hex)
+{
+	int a, b;
+
+	a = hex2num(*hex++);
+	if (a < 0)
+		return -1;
+
+	b = hex2num(*hex++);
+	if (b < 0)
+		return -1;
+
+	return (a << 4) | b;
+}
+
+static int hexstr2bin(const char *hex, char *buffer, int len)
+{
+	const char *ipos = hex;
+	char *opos = buffer;
+	int i, a;
+
+	for (i = 0; i < len; i++) {
+		a = hex2byte(ipos);
+		if (a < 0)
+			return -1;
+
+		*opos++ = a;
+		ipos += 2;
+	}
+
+	return 0;
+}
+
+static int convert_message(struct blob_attr *attr)
+{
+	char *data;
+	int len;
+
+	data = blobmsg_data(attr);
+	len = strlen(data);
+	if (len % 2)
+		return -1;
+
+	if (hexstr2bin(data, data, len / 2))
+		return -1;
+
+	return len / 2;
+}
+
+int usbmode_parse_config(struct usbmode_ctx *ctx, struct blob_attr *attr)
+{
+	enum {
+		CONF_MESSAGES,
+		CONF_DEVICES,
+		__CONF_MAX
+	};
+	static const struct blobmsg_policy policy[__CONF_MAX] = {
+		[CONF_MESSAGES] = { .name = "messages", .type = BLOBMSG_TYPE_ARRAY },
+		[CONF_DEVICES] = { .name = "devices", .type = BLOBMSG_TYPE_TABLE },
+	};
+	struct blob_attr *tb[__CONF_MAX];
+	struct blob_attr *cur;
+	struct device *dev;
+	int rem;
+
+	blobmsg_parse(policy, __CONF_MAX, tb, blob_data(attr), blob_len(attr));
+	if (!tb[CONF_MESSAGES] || !tb[CONF_DEVICES]) {
+		fprintf(stderr, "Configuration incomplete\n");
+		return -1;
+	}
+
+	blobmsg_for_each_attr(cur, tb[CONF_MESSAGES], rem)
+		ctx->n_messages++;
+
+	ctx->messages = calloc(ctx->n_messages, sizeof(*ctx->messages));
+	ctx->message_len = calloc(ctx->n_messages, sizeof(*ctx->message_len));
+	ctx->n_messages = 0;
+	blobmsg_for_each_attr(cur, tb[CONF_MESSAGES], rem) {
+		int len = convert_message(cur);
+
+		if (len < 0) {
+			fprintf(stderr, "Invalid data in message %d\n", ctx->n_messages);
+			return -1;
+		}
+
+		ctx->message_len[ctx->n_messages] = len;
+		ctx->messages[ctx->n_messages++] = blobmsg_data(cur);
+	}
+
+	blobmsg_for_each_attr(cur, tb[CONF_DEVICES], rem) {
+	    dev = calloc(1, sizeof(*dev));
+	    dev->avl.key = blobmsg_name(cur);
+	    dev->data = cur;
+	    avl_insert(&ctx->devices, &dev->avl);
+	}
+
+	return 0;
+}
+
+void usbmode_free_config(struct usbmode_ctx *ctx)
+{
+	struct device *dev, *tmp;
+
+	avl_remove_all_elements(&ctx->devices, dev, avl, tmp)
+		free(dev);
+
+	free(ctx->messages);
+	free(ctx->message_len);
+	ctx->messages = NULL;
+	ctx->message_len = NULL;
+	ctx->n_messages = 0;
+}
+
+struct blob_attr *
+usbmode_find_dev_data(struct usbdev_data *data, struct device *dev)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blobmsg_for_each_attr(cur, dev->data, rem) {
+		const char *name = blobmsg_name(cur);
+		const char *next;
+		char *val;
+
+		if (!strcmp(blobmsg_name(cur), "*"))
+			return cur;
+
+		next = strchr(name, '=');
+		if (!next)
+			continue;
+
+		next++;
+		if (!strncmp(name, "uMa", 3)) {
+			val = data->mfg;
+		} else if (!strncmp(name, "uPr", 3)) {
+			val = data->prod;
+		} else if (!strncmp(name, "uSe", 3)) {
+			val = data->serial;
+		} else {
+			/* ignore unsupported scsi attributes */
+			return cur;
+		}
+
+		if (!strcmp(val, next))
+			return cur;
+	}
+
+	return NULL;
+}
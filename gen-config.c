@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Converts a JSON config into a C source file holding the equivalent blobmsg
+ * buffer, so that usbmode can be built without the JSON parser.
+ * The blob format is stored in network byte order and is therefore the
+ * same on build host and target.
+ */
+#include <stdio.h>
+
+#include <libubox/blobmsg_json.h>
+
+static struct blob_buf conf;
+
+int main(int argc, char **argv)
+{
+	const unsigned char *data;
+	FILE *f;
+	size_t i, len;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <config.json> <output.c>\n", argv[0]);
+		return 1;
+	}
+
+	blob_buf_init(&conf, 0);
+	if (!blobmsg_add_json_from_file(&conf, argv[1])) {
+		fprintf(stderr, "Failed to load config file %s\n", argv[1]);
+		return 1;
+	}
+
+	f = fopen(argv[2], "w");
+	if (!f) {
+		fprintf(stderr, "Failed to create %s\n", argv[2]);
+		return 1;
+	}
+
+	data = (const unsigned char *) conf.head;
+	len = blob_raw_len(conf.head);
+
+	fprintf(f, "/* Generated from %s, do not edit */\n\n"
+		"/* not const: messages are converted in place by usbmode_parse_config() */\n"
+		"unsigned char builtin_config[] __attribute__((aligned(4))) = {", argv[1]);
+	for (i = 0; i < len; i++)
+		fprintf(f, "%s0x%02x,", (i % 12) ? " " : "\n\t", data[i]);
+	fprintf(f, "\n};\n");
+
+	if (fclose(f)) {
+		fprintf(stderr, "Failed to write %s\n", argv[2]);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <stdio.h>
+
+#include <libubox/blobmsg_json.h>
+#include "switch.h"
+#include "usbmode.h"
+
+struct usbmode_switch {
+	struct usbmode_ctx *ctx;
+	usbmode_cb_t cb;
+	void *priv;
+};
+
+struct usbmode_ctx *usbmode_new(libusb_context *usb_ctx)
+{
+	struct usbmode_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	if (!usb_ctx) {
+		if (libusb_init(&usb_ctx)) {
+			free(ctx);
+			return NULL;
+		}
+		ctx->own_usb = true;
+	}
+
+	ctx->usb = usb_ctx;
+	usbmode_init_config(ctx);
+	usbmode_dev_init(ctx);
+
+	return ctx;
+}
+
+int usbmode_free(struct usbmode_ctx *ctx)
+{
+	if (ctx->n_pending)
+		return LIBUSB_ERROR_BUSY;
+
+	usbmode_free_config(ctx);
+	blob_buf_free(&ctx->conf);
+
+	usbmode_dev_cleanup(ctx);
+	if (ctx->own_usb)
+		libusb_exit(ctx->usb);
+
+	free(ctx);
+	return 0;
+}
+
+int usbmode_load_config(struct usbmode_ctx *ctx, const char *file)
+{
+	if (ctx->n_pending)
+		return LIBUSB_ERROR_BUSY;
+
+	usbmode_free_config(ctx);
+	blob_buf_init(&ctx->conf, 0);
+	if (!blobmsg_add_json_from_file(&ctx->conf, file))
+		return LIBUSB_ERROR_IO;
+
+	if (usbmode_parse_config(ctx, ctx->conf.head)) {
+		usbmode_free_config(ctx);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	return 0;
+}
+
+void usbmode_set_reset_on_error(struct usbmode_ctx *ctx, bool reset)
+{
+	ctx->reset_on_error = reset;
+}
+
+void usbmode_set_budget(struct usbmode_ctx *ctx, int device_secs, int run_secs)
+{
+	ctx->device_budget = device_secs;
+	ctx->run_budget = run_secs;
+	usbmode_reset_budget(ctx);
+}
+
+bool usbmode_match(struct usbmode_ctx *ctx, uint16_t vid, uint16_t pid,
+		   const char *mfg, const char *prod, const char *serial)
+{
+	struct usbdev_data data = {};
+	struct device *dev;
+
+	data.desc.idVendor = vid;
+	data.desc.idProduct = pid;
+	snprintf(data.mfg, sizeof(data.mfg), "%s", mfg ? mfg : "");
+	snprintf(data.prod, sizeof(data.prod), "%s", prod ? prod : "");
+	snprintf(data.serial, sizeof(data.serial), "%s", serial ? serial : "");
+
+	dev = usbmode_dev_lookup(ctx, &data);
+	return dev && usbmode_find_dev_data(&data, dev);
+}
+
+static void usbmode_switch_done(struct usbdev_data *data)
+{
+	struct usbmode_switch *sw = data->done_priv;
+	struct usbmode_ctx *ctx = sw->ctx;
+	libusb_device *dev = data->dev;
+	int ret = data->ret;
+
+	usbmode_dev_free(data);
+	ctx->n_pending--;
+
+	if (sw->cb)
+		sw->cb(ctx, dev, ret, sw->priv);
+	free(sw);
+}
+
+int usbmode_switch(struct usbmode_ctx *ctx, libusb_device *dev,
+		   usbmode_cb_t cb, void *priv)
+{
+	struct usbmode_switch *sw;
+	struct usbdev_data *data;
+	int ret;
+
+	sw = calloc(1, sizeof(*sw));
+	if (!sw)
+		return LIBUSB_ERROR_NO_MEM;
+
+	ret = usbmode_dev_open(ctx, dev, &data);
+	if (ret) {
+		free(sw);
+		return ret;
+	}
+
+	sw->ctx = ctx;
+	sw->cb = cb;
+	sw->priv = priv;
+
+	data->done = usbmode_switch_done;
+	data->done_priv = sw;
+	ctx->n_pending++;
+	usbmode_handle_switch(data);
+
+	return 0;
+}
+
+int usbmode_pending(struct usbmode_ctx *ctx)
+{
+	return ctx->n_pending;
+}
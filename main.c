@@ -2,297 +2,279 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <stdbool.h>
-#include <ctype.h>
 
-#include <libubox/blobmsg_json.h>
-#include <libubox/avl.h>
-#include <libubox/avl-cmp.h>
+#include <libubox/uloop.h>
 #include "switch.h"
 
-#define DEFAULT_CONFIG "/etc/usb-mode.json"
+#ifdef BUILTIN_CONFIG
+#define CONFIG_OPTS ""
 
-struct device {
-	struct avl_node avl;
-	struct blob_attr *data;
-};
+extern unsigned char builtin_config[];
+#else
+#include <libubox/blobmsg_json.h>
+
+#define CONFIG_OPTS "c:"
+#define DEFAULT_CONFIG "/etc/usb-mode.json"
 
-static int verbose = 0;
 static const char *config_file = DEFAULT_CONFIG;
 static struct blob_buf conf;
+#endif
 
-char **messages = NULL;
-int *message_len;
-int n_messages = 0;
-
-static struct avl_tree devices;
-
-struct libusb_context *usb;
+static int verbose = 0;
+static struct usbmode_ctx ctx;
 static struct libusb_device **usbdevs;
 static int n_usbdevs;
+static int n_pending;
 
-static int hex2num(char c)
-{
-	if (c >= '0' && c <= '9')
-		return c - '0';
-
-	c = toupper(c);
-	if (c >= 'A' && c <= 'F')
-		return c - 'A' + 10;
-
-	return -1;
-}
+typedef void (*cmd_cb_t)(struct usbdev_data *data);
 
-static int hex2byte(const char *hex)
-{
-	int a, b;
+struct finished_dev {
+	char idstr[10];
+	int priority;
+	int ret;
+	int time;
+};
 
-	a = hex2num(*hex++);
-	if (a < 0)
-		return -1;
+static struct usbdev_data **queue;
+static int n_queued, next_queued;
+static bool queue_starting;
+static cmd_cb_t queue_cb;
 
-	b = hex2num(*hex++);
-	if (b < 0)
-		return -1;
+static struct finished_dev *finished;
+static int n_finished;
+static int64_t run_start;
 
-	return (a << 4) | b;
-}
+static const char *device;
+static int device_bus, device_addr;
 
-static int hexstr2bin(const char *hex, char *buffer, int len)
+static int usage(const char *prog)
 {
-	const char *ipos = hex;
-	char *opos = buffer;
-	int i, a;
-
-	for (i = 0; i < len; i++) {
-		a = hex2byte(ipos);
-		if (a < 0)
-			return -1;
-
-		*opos++ = a;
-		ipos += 2;
-	}
-
-	return 0;
+	fprintf(stderr, "Usage: %s <command> <options>\n"
+		"Commands:\n"
+		"	-l		List matching devices\n"
+		"	-s		Modeswitch matching devices\n"
+		"\n"
+		"Options:\n"
+		"	-v		Verbose output\n"
+#ifndef BUILTIN_CONFIG
+		"	-c <file>	Set configuration file to <file> (default: " DEFAULT_CONFIG ")\n"
+#endif
+		"	-r		Reset the USB port of devices that fail to switch\n"
+		"	-d <device>	Only handle the given device node (e.g. /dev/bus/usb/001/002)\n"
+		"	-t <secs>	Give up on a device after <secs> (default: no limit)\n"
+		"	-T <secs>	Give up on all devices <secs> after the first switch (default: no limit)\n"
+		"\n", prog);
+	return 1;
 }
 
-static int convert_message(struct blob_attr *attr)
+#ifdef BUILTIN_CONFIG
+static int load_config(void)
 {
-	char *data;
-	int len;
-
-	data = blobmsg_data(attr);
-	len = strlen(data);
-	if (len % 2)
-		return -1;
-
-	if (hexstr2bin(data, data, len / 2))
-		return -1;
-
-	return len / 2;
+	return usbmode_parse_config(&ctx, (struct blob_attr *) builtin_config);
 }
-
-static int parse_config(void)
+#else
+static int load_config(void)
 {
-	enum {
-		CONF_MESSAGES,
-		CONF_DEVICES,
-		__CONF_MAX
-	};
-	static const struct blobmsg_policy policy[__CONF_MAX] = {
-		[CONF_MESSAGES] = { .name = "messages", .type = BLOBMSG_TYPE_ARRAY },
-		[CONF_DEVICES] = { .name = "devices", .type = BLOBMSG_TYPE_TABLE },
-	};
-	struct blob_attr *tb[__CONF_MAX];
-	struct blob_attr *cur;
-	struct device *dev;
-	int rem;
-
-	blobmsg_parse(policy, __CONF_MAX, tb, blob_data(conf.head), blob_len(conf.head));
-	if (!tb[CONF_MESSAGES] || !tb[CONF_DEVICES]) {
-		fprintf(stderr, "Configuration incomplete\n");
+	blob_buf_init(&conf, 0);
+	if (!blobmsg_add_json_from_file(&conf, config_file))
 		return -1;
-	}
 
-	blobmsg_for_each_attr(cur, tb[CONF_MESSAGES], rem)
-		n_messages++;
+	return usbmode_parse_config(&ctx, conf.head);
+}
+#endif
 
-	messages = calloc(n_messages, sizeof(*messages));
-	message_len = calloc(n_messages, sizeof(*message_len));
-	n_messages = 0;
-	blobmsg_for_each_attr(cur, tb[CONF_MESSAGES], rem) {
-		int len = convert_message(cur);
+static void queue_run(void);
 
-		if (len < 0) {
-			fprintf(stderr, "Invalid data in message %d\n", n_messages);
-			return -1;
-		}
+static void usbdev_done(struct usbdev_data *data)
+{
+	struct finished_dev *f = &finished[n_finished++];
 
-		message_len[n_messages] = len;
-		messages[n_messages++] = blobmsg_data(cur);
-	}
+	strcpy(f->idstr, data->idstr);
+	f->priority = data->priority;
+	f->ret = data->ret;
+	f->time = usbmode_time_ms() - run_start;
 
-	blobmsg_for_each_attr(cur, tb[CONF_DEVICES], rem) {
-	    dev = calloc(1, sizeof(*dev));
-	    dev->avl.key = blobmsg_name(cur);
-	    dev->data = cur;
-	    avl_insert(&devices, &dev->avl);
-	}
+	usbmode_dev_free(data);
 
-	return 0;
+	if (!--n_pending && !queue_starting)
+		queue_run();
 }
 
-static int usage(const char *prog)
+/*
+ * Matching devices are handed to cb, which owns them until it calls
+ * data->done(). The uloop runs until every device is done.
+ */
+static void usbdev_start(struct usbdev_data *data, cmd_cb_t cb)
 {
-	fprintf(stderr, "Usage: %s <command> <options>\n"
-		"Commands:\n"
-		"	-l		List matching devices\n"
-		"	-s		Modeswitch matching devices\n"
-		"\n"
-		"Options:\n"
-		"	-v		Verbose output\n"
-		"	-c <file>	Set configuration file to <file> (default: %s)\n"
-		"\n", prog, DEFAULT_CONFIG);
-	return 1;
+	data->done = usbdev_done;
+	n_pending++;
+	cb(data);
 }
 
-typedef void (*cmd_cb_t)(struct usbdev_data *data);
-
-static struct blob_attr *
-find_dev_data(struct usbdev_data *data, struct device *dev)
+/*
+ * Devices are switched in groups of equal priority, highest first. A group
+ * only starts once the previous one is done, so that slow switches of less
+ * important devices do not hold up e.g. the primary WAN modem.
+ */
+static void queue_run(void)
 {
-	struct blob_attr *cur;
-	int rem;
+	int prio;
 
-	blobmsg_for_each_attr(cur, dev->data, rem) {
-		const char *name = blobmsg_name(cur);
-		const char *next;
-		char *val;
+	while (!n_pending && next_queued < n_queued) {
+		prio = queue[next_queued]->priority;
 
-		if (!strcmp(blobmsg_name(cur), "*"))
-			return cur;
+		queue_starting = true;
+		while (next_queued < n_queued && queue[next_queued]->priority == prio)
+			usbdev_start(queue[next_queued++], queue_cb);
+		queue_starting = false;
+	}
 
-		next = strchr(name, '=');
-		if (!next)
-			continue;
+	if (!n_pending)
+		uloop_end();
+}
 
-		next++;
-		if (!strncmp(name, "uMa", 3)) {
-			val = data->mfg;
-		} else if (!strncmp(name, "uPr", 3)) {
-			val = data->prod;
-		} else if (!strncmp(name, "uSe", 3)) {
-			val = data->serial;
-		} else {
-			/* ignore unsupported scsi attributes */
-			return cur;
-		}
+/* keeps devices of the same priority in bus order */
+static void queue_add(struct usbdev_data *data)
+{
+	int i;
 
-		if (!strcmp(val, next))
-			return cur;
-	}
+	data->priority = usbmode_switch_priority(data);
+	for (i = n_queued++; i > 0 && queue[i - 1]->priority < data->priority; i--)
+		queue[i] = queue[i - 1];
 
-	return NULL;
+	queue[i] = data;
 }
 
-static void
-parse_interface_config(libusb_device *dev, struct usbdev_data *data)
+static void print_summary(void)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_interface *iface;
-	const struct libusb_interface_descriptor *alt;
 	int i;
 
-	data->interface = -1;
-	if (libusb_get_config_descriptor(dev, 0, &config))
+	if (!n_finished)
 		return;
 
-	data->config = config;
-	if (!config->bNumInterfaces)
+	fprintf(stderr, "Summary:\n");
+	for (i = 0; i < n_finished; i++)
+		fprintf(stderr, "	%s (priority %d): finished after %d ms, %s\n",
+			finished[i].idstr, finished[i].priority, finished[i].time,
+			finished[i].ret ? libusb_error_name(finished[i].ret) : "ok");
+}
+
+static void iterate_devs(cmd_cb_t cb)
+{
+	struct usbdev_data *data;
+	int i;
+
+	if (!cb || n_usbdevs <= 0)
 		return;
 
-	iface = &config->interface[0];
-	if (!iface->num_altsetting)
+	queue = calloc(n_usbdevs, sizeof(*queue));
+	finished = calloc(n_usbdevs, sizeof(*finished));
+	if (!queue || !finished)
 		return;
 
-	alt = &iface->altsetting[0];
-	data->interface = alt->bInterfaceNumber;
-	data->dev_class = alt->bInterfaceClass;
+	for (i = 0; i < n_usbdevs; i++) {
+		if (device && (libusb_get_bus_number(usbdevs[i]) != device_bus ||
+			       libusb_get_device_address(usbdevs[i]) != device_addr))
+			continue;
 
-	for (i = 0; i < alt->bNumEndpoints; i++) {
-		const struct libusb_endpoint_descriptor *ep = &alt->endpoint[i];
-		bool out = false;
+		if (usbmode_dev_open(&ctx, usbdevs[i], &data))
+			continue;
 
-		if (data->msg_endpoint && data->response_endpoint)
-			break;
+		queue_add(data);
+	}
 
-		if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) !=
-		    LIBUSB_TRANSFER_TYPE_BULK)
-			continue;
+	queue_cb = cb;
+	queue_run();
+	if (n_pending)
+		uloop_run();
+
+	if (cb == usbmode_handle_switch)
+		print_summary();
+
+	free(queue);
+	free(finished);
+}
 
-		out = (ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ==
-		      LIBUSB_ENDPOINT_OUT;
+static int libusb_devs(cmd_cb_t cb)
+{
+	int ret;
 
-		if (!data->msg_endpoint && out)
-			data->msg_endpoint = ep->bEndpointAddress;
-		if (!data->response_endpoint && !out)
-			data->response_endpoint = ep->bEndpointAddress;
+	ret = libusb_init(&ctx.usb);
+	if (ret) {
+		fprintf(stderr, "Failed to initialize libusb: %s\n", libusb_error_name(ret));
+		return 1;
 	}
+
+	usbmode_dev_init(&ctx);
+	n_usbdevs = libusb_get_device_list(ctx.usb, &usbdevs);
+	iterate_devs(cb);
+	libusb_free_device_list(usbdevs, 1);
+	usbmode_dev_cleanup(&ctx);
+	libusb_exit(ctx.usb);
+
+	return 0;
 }
 
-static void iterate_devs(cmd_cb_t cb)
+#ifdef USBFS
+static int usbfs_devs(cmd_cb_t cb)
 {
-	struct usbdev_data data;
+	struct usbdev_data *data;
 	struct device *dev;
-	int i;
 
 	if (!cb)
-		return;
-
-	for (i = 0; i < n_usbdevs; i++) {
-		memset(&data, 0, sizeof(data));
-
-		if (libusb_get_device_descriptor(usbdevs[i], &data.desc))
-			continue;
+		return 0;
 
-		sprintf(data.idstr, "%04x:%04x", data.desc.idVendor, data.desc.idProduct);
+	finished = calloc(1, sizeof(*finished));
+	if (!finished)
+		return 1;
 
-		dev = avl_find_element(&devices, data.idstr, dev, avl);
-		if (!dev)
-			continue;
+	usbmode_dev_init(&ctx);
+	data = usbfs_open(&ctx, device);
+	if (!data)
+		return 1;
 
-		if (libusb_open(usbdevs[i], &data.devh))
-			continue;
+	dev = usbmode_dev_lookup(&ctx, data);
+	if (!dev || !usbmode_dev_claim(data) || !usbmode_dev_match(data, dev)) {
+		usbmode_dev_free(data);
+		return 0;
+	}
 
-		data.dev = usbdevs[i];
+	data->priority = usbmode_switch_priority(data);
+	usbdev_start(data, cb);
+	if (n_pending)
+		uloop_run();
 
-		libusb_get_string_descriptor_ascii(
-			data.devh, data.desc.iManufacturer,
-			(void *) data.mfg, sizeof(data.mfg));
-		libusb_get_string_descriptor_ascii(
-			data.devh, data.desc.iProduct,
-			(void *) data.prod, sizeof(data.prod));
-		libusb_get_string_descriptor_ascii(
-			data.devh, data.desc.iSerialNumber,
-			(void *) data.serial, sizeof(data.serial));
+	if (cb == usbmode_handle_switch)
+		print_summary();
 
-		parse_interface_config(usbdevs[i], &data);
+	free(finished);
+	return 0;
+}
+#endif
 
-		data.info = find_dev_data(&data, dev);
-		if (data.info)
-			cb(&data);
+/* accepts both the device node path and the hotplug DEVNAME (bus/usb/...) */
+static int parse_device(const char *name)
+{
+	static char path[64];
 
-		if (data.config)
-			libusb_free_config_descriptor(data.config);
+	if (name[0] != '/') {
+		snprintf(path, sizeof(path), "/dev/%s", name);
+		device = path;
+	}
 
-		if (data.devh)
-			libusb_close(data.devh);
+	if (sscanf(device, "/dev/bus/usb/%d/%d", &device_bus, &device_addr) != 2) {
+		fprintf(stderr, "Invalid device node: %s\n", name);
+		return -1;
 	}
+
+	return 0;
 }
 
 static void handle_list(struct usbdev_data *data)
 {
 	fprintf(stderr, "Found device: %s (Manufacturer: \"%s\", Product: \"%s\", Serial: \"%s\")\n",
 		data->idstr, data->mfg, data->prod, data->serial);
+	data->done(data);
 }
 
 int main(int argc, char **argv)
@@ -301,19 +283,31 @@ int main(int argc, char **argv)
 	int ret;
 	int ch;
 
-	avl_init(&devices, avl_strcmp, false, NULL);
-
-	while ((ch = getopt(argc, argv, "lsc:v")) != -1) {
+	while ((ch = getopt(argc, argv, "ls" CONFIG_OPTS "rd:t:T:v")) != -1) {
 		switch (ch) {
 		case 'l':
 			cb = handle_list;
 			break;
 		case 's':
-			cb = handle_switch;
+			cb = usbmode_handle_switch;
 			break;
+#ifndef BUILTIN_CONFIG
 		case 'c':
 			config_file = optarg;
 			break;
+#endif
+		case 'r':
+			ctx.reset_on_error = true;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			ctx.device_budget = atoi(optarg);
+			break;
+		case 'T':
+			ctx.run_budget = atoi(optarg);
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -322,23 +316,25 @@ int main(int argc, char **argv)
 		}
 	}
 
-	blob_buf_init(&conf, 0);
-	if (!blobmsg_add_json_from_file(&conf, config_file) ||
-	    parse_config()) {
+	usbmode_init_config(&ctx);
+	if (load_config()) {
 		fprintf(stderr, "Failed to load config file\n");
 		return 1;
 	}
 
-	ret = libusb_init(&usb);
-	if (ret) {
-		fprintf(stderr, "Failed to initialize libusb: %s\n", libusb_error_name(ret));
-		return 1;
-	}
+	if (device && parse_device(device))
+		return usage(argv[0]);
 
-	n_usbdevs = libusb_get_device_list(usb, &usbdevs);
-	iterate_devs(cb);
-	libusb_free_device_list(usbdevs, 1);
-	libusb_exit(usb);
+	run_start = usbmode_time_ms();
 
-	return 0;
+	uloop_init();
+#ifdef USBFS
+	if (device)
+		ret = usbfs_devs(cb);
+	else
+#endif
+		ret = libusb_devs(cb);
+	uloop_done();
+
+	return ret;
 }
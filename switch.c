@@ -1,6 +1,40 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
-#include <unistd.h>
+#include <time.h>
 #include "switch.h"
+#include "modes.h"
+
+#define REENUM_TIMEOUT	10000
+#define REENUM_POLL	100
+
+#if defined(CONFIG_MODE_GENERIC) || defined(CONFIG_MODE_HUAWEINEW) || \
+    defined(CONFIG_MODE_OPTION) || defined(CONFIG_MODE_STANDARDEJECT) || \
+    defined(CONFIG_MODE_CISCO)
+#define NEED_SEND_MESSAGES
+#endif
+
+#if defined(CONFIG_MODE_HUAWEI) || defined(CONFIG_MODE_SIERRA) || \
+    defined(CONFIG_MODE_SONY) || defined(CONFIG_MODE_GCT) || \
+    defined(CONFIG_MODE_KOBIL) || defined(CONFIG_MODE_SEQUANS) || \
+    defined(CONFIG_MODE_QUANTA) || defined(CONFIG_MODE_BLACKBERRY) || \
+    defined(CONFIG_MODE_PANTECH)
+#define NEED_CONTROL_PACKET
+#endif
+
+#if defined(NEED_SEND_MESSAGES) || defined(CONFIG_MODE_SONY) || \
+    defined(CONFIG_MODE_GCT) || defined(CONFIG_MODE_KOBIL) || \
+    defined(CONFIG_MODE_QUANTA) || defined(CONFIG_MODE_BLACKBERRY) || \
+    defined(CONFIG_MODE_PANTECH)
+#define NEED_DETACH_DRIVER
+#endif
+
+#if defined(NEED_CONTROL_PACKET) || defined(CONFIG_MODE_QISDA) || \
+    defined(CONFIG_MODE_MOBILEACTION)
+#define NEED_CONTROL_TRANSFER
+#endif
+
+#if defined(CONFIG_MODE_MOBILEACTION)
+#define NEED_ASYNC
+#endif
 
 enum {
 	DATA_MODE,
@@ -14,14 +48,155 @@ enum {
 	DATA_CONFIG,
 	DATA_ALT,
 	DATA_DEV_CLASS,
+	DATA_RESET,
+	DATA_WAIT,
+	DATA_DEADLINE,
+	DATA_PRIORITY,
 	__DATA_MAX
 };
 
+static const struct blobmsg_policy data_policy[__DATA_MAX] = {
+	[DATA_MODE] = { .name = "mode", .type = BLOBMSG_TYPE_STRING },
+	[DATA_MODEVAL] = { .name = "modeval", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_MSG] = { .name = "msg", .type = BLOBMSG_TYPE_ARRAY },
+	[DATA_INTERFACE] = { .name = "interface", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_MSG_EP] = { .name = "msg_endpoint", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_RES_EP] = { .name = "response_endpoint", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_RESPONSE] = { .name = "response", .type = BLOBMSG_TYPE_BOOL },
+	[DATA_RELEASE_DELAY] = { .name = "release_delay", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_CONFIG] = { .name = "config", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_ALT] = { .name = "alt", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_DEV_CLASS] = { .name = "t_class", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_RESET] = { .name = "reset", .type = BLOBMSG_TYPE_BOOL },
+	[DATA_WAIT] = { .name = "wait", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_DEADLINE] = { .name = "deadline", .type = BLOBMSG_TYPE_INT32 },
+	[DATA_PRIORITY] = { .name = "priority", .type = BLOBMSG_TYPE_INT32 },
+};
+
+enum {
+	SWITCH_WAIT,
+	SWITCH_MODE,
+	SWITCH_CONFIG,
+	SWITCH_ALT,
+	SWITCH_RESET,
+	SWITCH_DONE,
+};
+
+static void switch_parse(struct usbdev_data *data, struct blob_attr **tb)
+{
+	blobmsg_parse(data_policy, __DATA_MAX, tb, blobmsg_data(data->info), blobmsg_data_len(data->info));
+}
+
+/*
+ * Suspend the switch of this device for msecs. The resume callback (if any)
+ * runs once the timer expires, the remaining steps continue after it.
+ * Without any time budget left, it runs right away.
+ */
+static void switch_delay(struct usbdev_data *data, int msecs, switch_cb_t resume)
+{
+	data->resume = resume;
+	uloop_timeout_set(&data->timeout, data->expired ? 0 : msecs);
+}
+
+int64_t usbmode_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Give up on a device whose time budget is used up. A pending delay fires
+ * right away, so that its resume callback can cancel outstanding transfers
+ * or clean up, and the remaining steps are skipped.
+ */
+static void switch_expire(struct usbdev_data *data)
+{
+	if (data->expired)
+		return;
+
+	data->expired = true;
+	fprintf(stderr, "Device %s: time budget exceeded, giving up\n", data->idstr);
+
+	if (data->timeout.pending)
+		uloop_timeout_set(&data->timeout, 0);
+}
+
+#if defined(NEED_CONTROL_TRANSFER) || defined(NEED_SEND_MESSAGES)
+/*
+ * Limit the timeout of a transfer to what is left of the time budget.
+ * Returns 0 if nothing is left.
+ */
+static unsigned int switch_budget(struct usbdev_data *data, unsigned int timeout)
+{
+	int64_t left;
+
+	if (data->expired)
+		return 0;
+
+	if (!data->deadline)
+		return timeout;
+
+	left = data->deadline - usbmode_time_ms();
+	if (left <= 0) {
+		switch_expire(data);
+		return 0;
+	}
+
+	return left < timeout ? left : timeout;
+}
+#endif
+
+#ifdef NEED_CONTROL_TRANSFER
+static int dev_control_transfer(struct usbdev_data *data, uint8_t type, uint8_t req,
+				uint16_t val, uint16_t idx, unsigned char *buf,
+				uint16_t len, unsigned int timeout)
+{
+	timeout = switch_budget(data, timeout);
+	if (!timeout)
+		return LIBUSB_ERROR_TIMEOUT;
+
+	return data->ops->control_transfer(data, type, req, val, idx, buf, len, timeout);
+}
+#endif
+
+#ifdef NEED_SEND_MESSAGES
+static int dev_bulk_transfer(struct usbdev_data *data, int ep, unsigned char *buf,
+			     int len, int *transferred, unsigned int timeout)
+{
+	*transferred = 0;
+	timeout = switch_budget(data, timeout);
+	if (!timeout)
+		return LIBUSB_ERROR_TIMEOUT;
+
+	return data->ops->bulk_transfer(data, ep, buf, len, transferred, timeout);
+}
+#endif
+
+#ifdef NEED_ASYNC
+static void switch_run(struct usbdev_data *data);
+
+/*
+ * Continue a switch that waits in switch_delay() before the timer expires,
+ * e.g. once the asynchronous transfers it waited for have completed.
+ */
+static void switch_wake(struct usbdev_data *data)
+{
+	uloop_timeout_cancel(&data->timeout);
+	data->resume = NULL;
+	switch_run(data);
+}
+#endif
+
+#ifdef NEED_DETACH_DRIVER
 static void detach_driver(struct usbdev_data *data)
 {
-	libusb_detach_kernel_driver(data->devh, data->interface);
+	data->ops->detach_kernel_driver(data, data->interface);
 }
+#endif
 
+#ifdef NEED_SEND_MESSAGES
 struct msg_entry {
 	char *data;
 	int len;
@@ -31,9 +206,9 @@ static int send_msg(struct usbdev_data *data, struct msg_entry *msg)
 {
 	int transferred;
 
-	return libusb_bulk_transfer(data->devh, data->msg_endpoint,
-				    (void *) msg->data, msg->len,
-				    &transferred, 3000);
+	return dev_bulk_transfer(data, data->msg_endpoint,
+				 (void *) msg->data, msg->len,
+				 &transferred, 3000);
 }
 
 static int read_response(struct usbdev_data *data, int len)
@@ -44,23 +219,29 @@ static int read_response(struct usbdev_data *data, int len)
 	if (len < 13)
 		len = 13;
 	buf = alloca(len);
-	ret = libusb_bulk_transfer(data->devh, data->response_endpoint,
-				   buf, len, &transferred, 3000);
-	libusb_bulk_transfer(data->devh, data->response_endpoint,
-			     buf, 13, &transferred, 100);
+	ret = dev_bulk_transfer(data, data->response_endpoint,
+				buf, len, &transferred, 3000);
+	dev_bulk_transfer(data, data->response_endpoint,
+			  buf, 13, &transferred, 100);
 	return ret;
 }
 
-static void send_messages(struct usbdev_data *data, struct msg_entry *msg, int n_msg)
+static void release_interface(struct usbdev_data *data)
+{
+	data->ops->release_interface(data, data->interface);
+}
+
+static int send_messages(struct usbdev_data *data, struct msg_entry *msg, int n_msg)
 {
-	int i, len;
+	int i, len, ret = 0;
 
-	libusb_claim_interface(data->devh, data->interface);
-	libusb_clear_halt(data->devh, data->msg_endpoint);
+	data->ops->claim_interface(data, data->interface);
+	data->ops->clear_halt(data, data->msg_endpoint);
 
-	for (i = 0; i < n_msg; i++) {
+	for (i = 0; i < n_msg && !data->expired; i++) {
 		if (send_msg(data, &msg[i])) {
 			fprintf(stderr, "Failed to send switch message\n");
+			ret = -1;
 			continue;
 		}
 
@@ -73,22 +254,19 @@ static void send_messages(struct usbdev_data *data, struct msg_entry *msg, int n
 			len = msg[i].len;
 
 		if (read_response(data, len))
-			return;
+			return -1;
 	}
 
-	libusb_clear_halt(data->devh, data->msg_endpoint);
-	libusb_clear_halt(data->devh, data->response_endpoint);
-
-	usleep(200000);
-
-	if (data->release_delay)
-		usleep(data->release_delay * 1000);
+	data->ops->clear_halt(data, data->msg_endpoint);
+	data->ops->clear_halt(data, data->response_endpoint);
 
-	libusb_release_interface(data->devh, data->interface);
-	return;
+	switch_delay(data, 200 + data->release_delay, release_interface);
+	return ret;
 }
+#endif
 
-static void send_config_messages(struct usbdev_data *data, struct blob_attr *attr)
+#ifdef CONFIG_MODE_GENERIC
+static int send_config_messages(struct usbdev_data *data, struct blob_attr *attr)
 {
 	struct blob_attr *cur;
 	int rem, n_msg = 0;
@@ -104,43 +282,55 @@ static void send_config_messages(struct usbdev_data *data, struct blob_attr *att
 
 		if (blobmsg_type(cur) != BLOBMSG_TYPE_INT32) {
 			fprintf(stderr, "Invalid data in message list\n");
-			return;
+			return -1;
 		}
 
 		msg_nr = blobmsg_get_u32(cur);
-		if (msg_nr >= n_messages) {
+		if (msg_nr >= data->ctx->n_messages) {
 			fprintf(stderr, "Message index out of range!\n");
-			return;
+			return -1;
 		}
 
-		msg[n_msg].data = messages[msg_nr];
-		msg[n_msg++].len = message_len[msg_nr];
+		msg[n_msg].data = data->ctx->messages[msg_nr];
+		msg[n_msg++].len = data->ctx->message_len[msg_nr];
 	}
 
-	send_messages(data, msg, n_msg);
+	return send_messages(data, msg, n_msg);
 }
 
-static void handle_generic(struct usbdev_data *data, struct blob_attr **tb)
+static int handle_generic(struct usbdev_data *data, struct blob_attr **tb)
 {
 	detach_driver(data);
-	send_config_messages(data, tb[DATA_MSG]);
+	return send_config_messages(data, tb[DATA_MSG]);
 }
+#else
+#define handle_generic NULL
+#endif
 
-static void send_control_packet(struct usbdev_data *data, uint8_t type, uint8_t req,
-				uint16_t val, uint16_t idx, int len)
+#ifdef NEED_CONTROL_PACKET
+static int send_control_packet(struct usbdev_data *data, uint8_t type, uint8_t req,
+			       uint16_t val, uint16_t idx, int len)
 {
 	unsigned char *buffer = alloca(len ? len : 1);
+	int ret;
 
-	libusb_control_transfer(data->devh, type, req, val, idx, buffer, len, 1000);
+	ret = dev_control_transfer(data, type, req, val, idx, buffer, len, 1000);
+	return ret < 0 ? ret : 0;
 }
+#endif
 
-static void handle_huawei(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_HUAWEI
+static int handle_huawei(struct usbdev_data *data, struct blob_attr **tb)
 {
 	int type = LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE;
-	send_control_packet(data, type, LIBUSB_REQUEST_SET_FEATURE, 1, 0, 0);
+	return send_control_packet(data, type, LIBUSB_REQUEST_SET_FEATURE, 1, 0, 0);
 }
+#else
+#define handle_huawei NULL
+#endif
 
-static void handle_huaweinew(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_HUAWEINEW
+static int handle_huaweinew(struct usbdev_data *data, struct blob_attr **tb)
 {
 	static struct msg_entry msgs[] = {
 		{
@@ -151,10 +341,14 @@ static void handle_huaweinew(struct usbdev_data *data, struct blob_attr **tb)
 
 	detach_driver(data);
 	data->need_response = false;
-	send_messages(data, msgs, ARRAY_SIZE(msgs));
+	return send_messages(data, msgs, ARRAY_SIZE(msgs));
 }
+#else
+#define handle_huaweinew NULL
+#endif
 
-static void handle_option(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_OPTION
+static int handle_option(struct usbdev_data *data, struct blob_attr **tb)
 {
 	static struct msg_entry msgs[] = {
 		{
@@ -165,10 +359,14 @@ static void handle_option(struct usbdev_data *data, struct blob_attr **tb)
 
 	detach_driver(data);
 	data->need_response = false;
-	send_messages(data, msgs, ARRAY_SIZE(msgs));
+	return send_messages(data, msgs, ARRAY_SIZE(msgs));
 }
+#else
+#define handle_option NULL
+#endif
 
-static void handle_standardeject(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_STANDARDEJECT
+static int handle_standardeject(struct usbdev_data *data, struct blob_attr **tb)
 {
 	static struct msg_entry msgs[] = {
 		{
@@ -188,116 +386,398 @@ static void handle_standardeject(struct usbdev_data *data, struct blob_attr **tb
 
 	detach_driver(data);
 	data->need_response = true;
-	send_messages(data, msgs, ARRAY_SIZE(msgs));
+	return send_messages(data, msgs, ARRAY_SIZE(msgs));
 }
+#else
+#define handle_standardeject NULL
+#endif
 
-static void handle_sierra(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_SIERRA
+static int handle_sierra(struct usbdev_data *data, struct blob_attr **tb)
 {
 	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
-	send_control_packet(data, type, LIBUSB_REQUEST_SET_INTERFACE, 1, 0, 0);
+	return send_control_packet(data, type, LIBUSB_REQUEST_SET_INTERFACE, 1, 0, 0);
 }
+#else
+#define handle_sierra NULL
+#endif
 
-static void handle_sony(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_SONY
+static void sony_reopen(struct usbdev_data *data)
 {
 	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN;
 	int i;
 
-	detach_driver(data);
-	send_control_packet(data, type, 0x11, 2, 0, 3);
-
-	libusb_close(data->devh);
-	sleep(5);
+	if (data->expired)
+		return;
 
 	for (i = 0; i < 25; i++) {
-		data->devh = libusb_open_device_with_vid_pid(usb,
-			data->desc.idVendor, data->desc.idProduct);
-		if (data->devh)
+		data->ret = data->ops->reopen(data);
+		if (!data->ret)
 			break;
 	}
 
+	if (data->ret)
+		return;
+
+	if (!usbmode_dev_claim(data)) {
+		data->ret = LIBUSB_ERROR_BUSY;
+		return;
+	}
+
+	data->ret = send_control_packet(data, type, 0x11, 2, 0, 3);
+}
+
+static int handle_sony(struct usbdev_data *data, struct blob_attr **tb)
+{
+	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN;
+
+	detach_driver(data);
 	send_control_packet(data, type, 0x11, 2, 0, 3);
+
+	data->ops->close(data);
+	usbmode_dev_unclaim(data);
+	switch_delay(data, 5000, sony_reopen);
+
+	return 0;
 }
+#else
+#define handle_sony NULL
+#endif
 
-static void handle_qisda(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_QISDA
+static int handle_qisda(struct usbdev_data *data, struct blob_attr **tb)
 {
 	static unsigned char buffer[] = "\x05\x8c\x04\x08\xa0\xee\x20\x00\x5c\x01\x04\x08\x98\xcd\xea\xbf";
 	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
 
-	libusb_control_transfer(data->devh, type, 0x04, 0, 0, buffer, 16, 1000);
+	if (dev_control_transfer(data, type, 0x04, 0, 0, buffer, 16, 1000) < 0)
+		return -1;
+
+	return 0;
 }
+#else
+#define handle_qisda NULL
+#endif
 
-static void handle_gct(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_GCT
+static int handle_gct(struct usbdev_data *data, struct blob_attr **tb)
 {
 	int type = LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_IN;
+	int ret, err;
 
 	detach_driver(data);
 
-	if (libusb_claim_interface(data->devh, data->interface))
-	    return;
+	ret = data->ops->claim_interface(data, data->interface);
+	if (ret)
+	    return ret;
 
-	send_control_packet(data, type, 0xa0, 0, data->interface, 1);
-	send_control_packet(data, type, 0xfe, 0, data->interface, 1);
+	ret = send_control_packet(data, type, 0xa0, 0, data->interface, 1);
+	err = send_control_packet(data, type, 0xfe, 0, data->interface, 1);
+	if (!ret)
+		ret = err;
 
-	libusb_release_interface(data->devh, data->interface);
+	data->ops->release_interface(data, data->interface);
+	return ret;
 }
+#else
+#define handle_gct NULL
+#endif
 
-static void handle_kobil(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_KOBIL
+static int handle_kobil(struct usbdev_data *data, struct blob_attr **tb)
 {
 	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
 
 	detach_driver(data);
-	send_control_packet(data, type, 0x88, 0, 0, 8);
+	return send_control_packet(data, type, 0x88, 0, 0, 8);
 }
+#else
+#define handle_kobil NULL
+#endif
 
-static void handle_sequans(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_SEQUANS
+static int handle_sequans(struct usbdev_data *data, struct blob_attr **tb)
 {
 	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
-	send_control_packet(data, type, LIBUSB_REQUEST_SET_INTERFACE, 2, 0, 0);
+	return send_control_packet(data, type, LIBUSB_REQUEST_SET_INTERFACE, 2, 0, 0);
 }
+#else
+#define handle_sequans NULL
+#endif
+
+#ifdef CONFIG_MODE_MOBILEACTION
+#define MA_EP_OUT	0x02
+#define MA_EP_IN	0x81
+#define MA_RING		8
+#define MA_TIMEOUT	10000
+#define MA_REAP_TIMEOUT	2000
+
+/* each message is followed by a number of interrupt reads */
+static const struct {
+	const char *msg;
+	int n_in;
+} mobile_action_steps[] = {
+	{ NULL, 2 },
+	{ "\x37\x01\xfe\xdb\xc1\x33\x1f\x83", 1 },
+	{ "\x37\x0e\xb5\x9d\x3b\x8a\x91\x51", 1 },
+	{ "\x34\x87\xba\x0d\xfc\x8a\x91\x51", 63 },
+	{ "\x37\x01\xfe\xdb\xc1\x33\x1f\x83", 1 },
+	{ "\x37\x0e\xb5\x9d\x3b\x8a\x91\x51", 1 },
+	{ "\x34\x87\xba\x0d\xfc\x8a\x91\x51", 73 },
+	{ "\x33\x04\xfe\x00\xf4\x6c\x1f\xf0", 1 },
+	{ "\x32\x07\xfe\xf0\x29\xb9\x3a\xf0", 1 },
+};
 
-static void mobile_action_interrupt_msg(struct usbdev_data *data, void *msg, int n_in)
+/*
+ * The interrupt reads of the whole handshake are kept queued in a ring of
+ * MA_RING transfers, so that every response is picked up as soon as the
+ * device sends it. Only the number of reads is counted, as before.
+ */
+struct mobile_action {
+	struct usbdev_xfer in[MA_RING];
+	struct usbdev_xfer out;
+	unsigned char buf[MA_RING][8];
+	unsigned char msg[8];
+
+	int step;
+	int step_reads;
+	int unsubmitted;
+	int inflight;
+	bool out_busy;
+	bool cancelled;
+	int64_t reap_start;
+	int ret;
+};
+
+static void mobile_action_submit(struct usbdev_data *data, struct usbdev_xfer *xfer)
 {
-	unsigned char *buf = alloca(8);
-	int ep_out = 0x02, ep_in = 0x81;
-	int transferred;
+	struct mobile_action *ma = data->mode_priv;
+	int ret;
+
+	ret = data->ops->submit_interrupt(xfer);
+	if (ret) {
+		ma->ret = ret;
+		return;
+	}
+
+	ma->inflight++;
+	if (xfer == &ma->out)
+		ma->out_busy = true;
+	else
+		ma->unsubmitted--;
+}
+
+/* send the next message once all reads of the current step are done */
+static void mobile_action_next(struct usbdev_data *data)
+{
+	struct mobile_action *ma = data->mode_priv;
+
+	while (!ma->ret && ma->step_reads <= 0 && !ma->out_busy) {
+		if (++ma->step == ARRAY_SIZE(mobile_action_steps))
+			return;
+
+		ma->step_reads += mobile_action_steps[ma->step].n_in;
+		if (!mobile_action_steps[ma->step].msg)
+			continue;
+
+		memcpy(ma->msg, mobile_action_steps[ma->step].msg, sizeof(ma->msg));
+		mobile_action_submit(data, &ma->out);
+	}
+}
+
+static void mobile_action_cancel(struct usbdev_data *data)
+{
+	struct mobile_action *ma = data->mode_priv;
 	int i;
 
-	if (msg)
-		libusb_interrupt_transfer(data->devh, ep_out, msg, 8, &transferred, 1000);
-	for (i = 0; i < n_in; i++)
-		libusb_interrupt_transfer(data->devh, ep_in, buf, 8, &transferred, 1000);
+	if (ma->cancelled)
+		return;
+
+	ma->cancelled = true;
+	for (i = 0; i < MA_RING; i++)
+		data->ops->cancel_transfer(&ma->in[i]);
+	data->ops->cancel_transfer(&ma->out);
 }
 
-static void handle_mobile_action(struct usbdev_data *data, struct blob_attr **tb)
+static void mobile_action_finish(struct usbdev_data *data)
 {
-	int type = LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
-	char *msg[] = {
-		"\xb0\x04\x00\x00\x02\x90\x26\x86",
-		"\x37\x01\xfe\xdb\xc1\x33\x1f\x83",
-		"\x37\x0e\xb5\x9d\x3b\x8a\x91\x51",
-		"\x34\x87\xba\x0d\xfc\x8a\x91\x51",
-		"\x37\x01\xfe\xdb\xc1\x33\x1f\x83",
-		"\x37\x0e\xb5\x9d\x3b\x8a\x91\x51",
-		"\x34\x87\xba\x0d\xfc\x8a\x91\x51",
-		"\x33\x04\xfe\x00\xf4\x6c\x1f\xf0",
-		"\x32\x07\xfe\xf0\x29\xb9\x3a\xf0"
-	};
+	struct mobile_action *ma = data->mode_priv;
 	int i;
 
+	for (i = 0; i < MA_RING; i++)
+		data->ops->free_transfer(&ma->in[i]);
+	data->ops->free_transfer(&ma->out);
+
+	data->ret = ma->ret;
+	if (data->ret)
+		fprintf(stderr, "Device %s: MobileAction handshake failed: %s\n",
+			data->idstr, libusb_error_name(data->ret));
+
+	data->mode_priv = NULL;
+	free(ma);
+}
+
+static void mobile_action_complete(struct usbdev_data *data)
+{
+	struct mobile_action *ma = data->mode_priv;
+
+	mobile_action_next(data);
+	if (!ma->ret && ma->step < ARRAY_SIZE(mobile_action_steps))
+		return;
+
+	mobile_action_cancel(data);
+	if (ma->inflight)
+		return;
+
+	mobile_action_finish(data);
+	switch_wake(data);
+}
+
+static void mobile_action_in_cb(struct usbdev_xfer *xfer)
+{
+	struct usbdev_data *data = xfer->data;
+	struct mobile_action *ma = data->mode_priv;
+
+	ma->inflight--;
+	if (xfer->status == LIBUSB_ERROR_NO_DEVICE && !ma->ret)
+		ma->ret = xfer->status;
+
+	if (!ma->ret) {
+		ma->step_reads--;
+		if (ma->unsubmitted)
+			mobile_action_submit(data, xfer);
+	}
+
+	mobile_action_complete(data);
+}
+
+static void mobile_action_out_cb(struct usbdev_xfer *xfer)
+{
+	struct usbdev_data *data = xfer->data;
+	struct mobile_action *ma = data->mode_priv;
+
+	ma->inflight--;
+	ma->out_busy = false;
+	if (xfer->status == LIBUSB_ERROR_NO_DEVICE && !ma->ret)
+		ma->ret = xfer->status;
+
+	mobile_action_complete(data);
+}
+
+/* completion of a transfer that was left behind after the handshake */
+static void mobile_action_orphan_cb(struct usbdev_xfer *xfer)
+{
+}
+
+/*
+ * Overall deadline of the handshake. Cancelled transfers still complete
+ * later, so the switch is kept on hold for up to MA_REAP_TIMEOUT until all
+ * of them are back. Any that are still outstanding after that are leaked
+ * rather than freed under the backend.
+ */
+static void mobile_action_expire(struct usbdev_data *data)
+{
+	struct mobile_action *ma = data->mode_priv;
+	int64_t left;
+	int i;
+
+	if (!ma->ret)
+		ma->ret = LIBUSB_ERROR_TIMEOUT;
+
+	mobile_action_cancel(data);
+	if (!ma->inflight) {
+		mobile_action_finish(data);
+		return;
+	}
+
+	if (!ma->reap_start)
+		ma->reap_start = usbmode_time_ms();
+
+	/*
+	 * Not switch_delay(), this has to wait even past the budget. The
+	 * timer may also have been fired early by switch_expire().
+	 */
+	left = ma->reap_start + MA_REAP_TIMEOUT - usbmode_time_ms();
+	if (left > 0) {
+		data->resume = mobile_action_expire;
+		uloop_timeout_set(&data->timeout, left);
+		return;
+	}
+
+	fprintf(stderr, "Device %s: %d MobileAction transfers did not complete\n",
+		data->idstr, ma->inflight);
+
+	for (i = 0; i < MA_RING; i++)
+		ma->in[i].cb = mobile_action_orphan_cb;
+	ma->out.cb = mobile_action_orphan_cb;
+
+	data->ret = LIBUSB_ERROR_TIMEOUT;
+	data->mode_priv = NULL;
+}
+
+static int handle_mobile_action(struct usbdev_data *data, struct blob_attr **tb)
+{
+	int type = LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
+	static unsigned char init[] = "\xb0\x04\x00\x00\x02\x90\x26\x86";
+	struct mobile_action *ma;
+	int i, ret;
+
+	if (!data->async) {
+		fprintf(stderr, "Device %s: MobileAction needs asynchronous transfers\n",
+			data->idstr);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
 	for (i = 0; i < 2; i++)
-		libusb_control_transfer(data->devh, type, 0x09, 0x0300, 0, (void *) msg[0], 8, 1000);
-	mobile_action_interrupt_msg(data, NULL, 2);
-	mobile_action_interrupt_msg(data, msg[1], 1);
-	mobile_action_interrupt_msg(data, msg[2], 1);
-	mobile_action_interrupt_msg(data, msg[3], 63);
-	mobile_action_interrupt_msg(data, msg[4], 1);
-	mobile_action_interrupt_msg(data, msg[5], 1);
-	mobile_action_interrupt_msg(data, msg[6], 73);
-	mobile_action_interrupt_msg(data, msg[7], 1);
-	mobile_action_interrupt_msg(data, msg[8], 1);
+		dev_control_transfer(data, type, 0x09, 0x0300, 0, init, 8, 1000);
+
+	ma = calloc(1, sizeof(*ma));
+	if (!ma)
+		return LIBUSB_ERROR_NO_MEM;
+
+	data->mode_priv = ma;
+	for (i = 0; i < ARRAY_SIZE(mobile_action_steps); i++)
+		ma->unsubmitted += mobile_action_steps[i].n_in;
+
+	for (i = 0; i < MA_RING; i++) {
+		ma->in[i].data = data;
+		ma->in[i].cb = mobile_action_in_cb;
+		ma->in[i].ep = MA_EP_IN;
+		ma->in[i].buf = ma->buf[i];
+		ma->in[i].len = sizeof(ma->buf[i]);
+	}
+
+	ma->out.data = data;
+	ma->out.cb = mobile_action_out_cb;
+	ma->out.ep = MA_EP_OUT;
+	ma->out.buf = ma->msg;
+	ma->out.len = sizeof(ma->msg);
+
+	for (i = 0; i < MA_RING && ma->unsubmitted && !ma->ret; i++)
+		mobile_action_submit(data, &ma->in[i]);
+
+	ma->step = -1;
+	mobile_action_next(data);
+
+	if (ma->ret && !ma->inflight) {
+		ret = ma->ret;
+		mobile_action_finish(data);
+		return ret;
+	}
+
+	if (ma->ret)
+		mobile_action_cancel(data);
+
+	switch_delay(data, MA_TIMEOUT, mobile_action_expire);
+	return 0;
 }
+#else
+#define handle_mobile_action NULL
+#endif
 
-static void handle_cisco(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_CISCO
+static int handle_cisco(struct usbdev_data *data, struct blob_attr **tb)
 {
 	static struct msg_entry msgs[] = {
 		{
@@ -339,62 +819,71 @@ static void handle_cisco(struct usbdev_data *data, struct blob_attr **tb)
 
 	detach_driver(data);
 	data->need_response = true;
-	send_messages(data, msgs, ARRAY_SIZE(msgs));
+	return send_messages(data, msgs, ARRAY_SIZE(msgs));
 }
+#else
+#define handle_cisco NULL
+#endif
 
-static void handle_mbim(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_MBIM
+static int handle_mbim(struct usbdev_data *data, struct blob_attr **tb)
 {
-	int j;
+	const struct usbdev_iface *mbim, *active;
+	int config = 0, count = 5;
 
 	if (data->desc.bNumConfigurations < 2)
-		return;
-
-	for (j = 0; j < data->desc.bNumConfigurations; j++) {
-		struct libusb_config_descriptor *config;
-		int i;
-
-		libusb_get_config_descriptor(data->dev, j, &config);
+		return 0;
 
-		for (i = 0; i < config->bNumInterfaces; i++) {
-			if (config->interface[i].altsetting[0].bInterfaceClass == 2) {
-				if (config->interface[i].altsetting[0].bInterfaceSubClass == 0x0e) {
-					struct libusb_config_descriptor *active;
-					int count = 5;
+	mbim = usbmode_dev_find_iface(data, -1, -1, 0, LIBUSB_CLASS_COMM, 0x0e);
+	if (!mbim)
+		return 0;
 
-				        libusb_get_active_config_descriptor(data->dev, &active);
-					if (active->bConfigurationValue == config->bConfigurationValue)
-						return;
-					while ((libusb_set_configuration(data->devh, config->bConfigurationValue) < 0) && --count)
-						libusb_detach_kernel_driver(data->devh, active->interface[0].altsetting[0].bInterfaceNumber);
+	data->ops->get_configuration(data, &config);
+	if (config == mbim->config_value)
+		return 0;
 
-					libusb_free_config_descriptor(config);
-					return;
-				}
-			}
-		}
+	active = usbmode_dev_find_iface(data, config, -1, 0, -1, -1);
+	while ((data->ops->set_configuration(data, mbim->config_value) < 0) && --count)
+		data->ops->detach_kernel_driver(data, active ? active->number : 0);
 
-		libusb_free_config_descriptor(config);
-	}
+	return count ? 0 : -1;
 }
+#else
+#define handle_mbim NULL
+#endif
 
-static void handle_quanta(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_QUANTA
+static int handle_quanta(struct usbdev_data *data, struct blob_attr **tb)
 {
 	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
 
 	detach_driver(data);
-	send_control_packet(data, type, 0xff, 0, 0, 8);
+	return send_control_packet(data, type, 0xff, 0, 0, 8);
 }
+#else
+#define handle_quanta NULL
+#endif
 
-static void handle_blackberry(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_BLACKBERRY
+static int handle_blackberry(struct usbdev_data *data, struct blob_attr **tb)
 {
 	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
+	int ret, err;
 
 	detach_driver(data);
-	send_control_packet(data, type, 0xb1, 0x0000, 0, 8);
-	send_control_packet(data, type, 0xa9, 0x000e, 0, 8);
+	ret = send_control_packet(data, type, 0xb1, 0x0000, 0, 8);
+	err = send_control_packet(data, type, 0xa9, 0x000e, 0, 8);
+	if (!ret)
+		ret = err;
+
+	return ret;
 }
+#else
+#define handle_blackberry NULL
+#endif
 
-static void handle_pantech(struct usbdev_data *data, struct blob_attr **tb)
+#ifdef CONFIG_MODE_PANTECH
+static int handle_pantech(struct usbdev_data *data, struct blob_attr **tb)
 {
 	int type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
 	int val = 1;
@@ -403,16 +892,79 @@ static void handle_pantech(struct usbdev_data *data, struct blob_attr **tb)
 		val = blobmsg_get_u32(tb[DATA_MODEVAL]);
 	detach_driver(data);
 	if (val > 1)
-		send_control_packet(data, type, 0x70, val, 0, 0);
+		return send_control_packet(data, type, 0x70, val, 0, 0);
+
+	return 0;
+}
+#else
+#define handle_pantech NULL
+#endif
+
+static int set_alt_setting(struct usbdev_data *data, int setting)
+{
+	int ret;
+
+	ret = data->ops->claim_interface(data, data->interface);
+	if (ret)
+		return ret;
+
+	ret = data->ops->set_alt_setting(data, data->interface, setting);
+	data->ops->release_interface(data, data->interface);
+	return ret;
 }
 
-static void set_alt_setting(struct usbdev_data *data, int setting)
+static void reset_poll(struct usbdev_data *data)
 {
-	if (libusb_claim_interface(data->devh, data->interface))
+	uint16_t vid, pid;
+	int elapsed;
+
+	elapsed = usbmode_time_ms() - data->reset_start;
+	if (data->ops->find_reenumerated(data, &vid, &pid)) {
+		if (data->expired) {
+			fprintf(stderr, "Device %s: time budget ran out %d ms into waiting for re-enumeration\n",
+				data->idstr, elapsed);
+			return;
+		}
+
+		if (elapsed < REENUM_TIMEOUT) {
+			switch_delay(data, REENUM_POLL, reset_poll);
+			return;
+		}
+
+		fprintf(stderr, "Device %s: not re-enumerated within %d ms after port reset\n",
+			data->idstr, elapsed);
 		return;
+	}
 
-	libusb_set_interface_alt_setting(data->devh, data->interface, setting);
-	libusb_release_interface(data->devh, data->interface);
+	fprintf(stderr, "Device %s: re-enumerated as %04x:%04x in %d ms after port reset\n",
+		data->idstr, vid, pid, elapsed);
+}
+
+/*
+ * A port reset either keeps the device as it is or, if its descriptors
+ * changed, makes it disconnect and come back under a new address on the
+ * same port. In the latter case wait for it to show up again.
+ */
+static void reset_device(struct usbdev_data *data)
+{
+	int ret;
+
+	data->reset_start = usbmode_time_ms();
+	ret = data->ops->reset(data);
+	if (!ret) {
+		fprintf(stderr, "Device %s: port reset done in %d ms\n",
+			data->idstr, (int) (usbmode_time_ms() - data->reset_start));
+		return;
+	}
+
+	if (ret != LIBUSB_ERROR_NOT_FOUND) {
+		fprintf(stderr, "Device %s: port reset failed: %s\n",
+			data->idstr, libusb_error_name(ret));
+		return;
+	}
+
+	usbmode_dev_unclaim(data);
+	switch_delay(data, REENUM_POLL, reset_poll);
 }
 
 enum {
@@ -438,7 +990,7 @@ enum {
 
 static const struct {
 	const char *name;
-	void (*cb)(struct usbdev_data *data, struct blob_attr **tb);
+	int (*cb)(struct usbdev_data *data, struct blob_attr **tb);
 } modeswitch_cb[__MODE_MAX] = {
 	[MODE_GENERIC] = { "Generic", handle_generic },
 	[MODE_STDEJECT] = { "StandardEject", handle_standardeject },
@@ -459,46 +1011,46 @@ static const struct {
 	[MODE_PANTECH] = { "Pantech", handle_pantech },
 };
 
-void handle_switch(struct usbdev_data *data)
-{
-	static const struct blobmsg_policy data_policy[__DATA_MAX] = {
-		[DATA_MODE] = { .name = "mode", .type = BLOBMSG_TYPE_STRING },
-		[DATA_MODEVAL] = { .name = "modeval", .type = BLOBMSG_TYPE_INT32 },
-		[DATA_MSG] = { .name = "msg", .type = BLOBMSG_TYPE_ARRAY },
-		[DATA_INTERFACE] = { .name = "interface", .type = BLOBMSG_TYPE_INT32 },
-		[DATA_MSG_EP] = { .name = "msg_endpoint", .type = BLOBMSG_TYPE_INT32 },
-		[DATA_RES_EP] = { .name = "response_endpoint", .type = BLOBMSG_TYPE_INT32 },
-		[DATA_RESPONSE] = { .name = "response", .type = BLOBMSG_TYPE_BOOL },
-		[DATA_CONFIG] = { .name = "config", .type = BLOBMSG_TYPE_INT32 },
-		[DATA_ALT] = { .name = "alt", .type = BLOBMSG_TYPE_INT32 },
-		[DATA_DEV_CLASS] = { .name = "t_class", .type = BLOBMSG_TYPE_INT32 },
-	};
-	struct blob_attr *tb[__DATA_MAX];
-	int mode = MODE_GENERIC;
-	int t_class = 0;
+#define CONFIG_DELAY	100
 
-	blobmsg_parse(data_policy, __DATA_MAX, tb, blobmsg_data(data->info), blobmsg_data_len(data->info));
-
-	if (tb[DATA_DEV_CLASS])
-		t_class = blobmsg_get_u32(tb[DATA_DEV_CLASS]);
+/*
+ * The device is left unconfigured until this runs, so it is done even once
+ * the budget is used up, after waiting out the rest of the delay.
+ */
+static void set_config(struct usbdev_data *data)
+{
+	struct blob_attr *tb[__DATA_MAX];
+	int64_t left;
 
-	if (tb[DATA_INTERFACE])
-		data->interface = blobmsg_get_u32(tb[DATA_INTERFACE]);
+	left = data->config_start + CONFIG_DELAY - usbmode_time_ms();
+	if (left > 0) {
+		data->resume = set_config;
+		uloop_timeout_set(&data->timeout, left);
+		return;
+	}
 
-	if (tb[DATA_MSG_EP])
-		data->msg_endpoint = blobmsg_get_u32(tb[DATA_MSG_EP]);
+	switch_parse(data, tb);
+	data->ops->set_configuration(data, blobmsg_get_u32(tb[DATA_CONFIG]));
+}
 
-	if (tb[DATA_RES_EP])
-		data->response_endpoint = blobmsg_get_u32(tb[DATA_RES_EP]);
+static void switch_config(struct usbdev_data *data, struct blob_attr **tb)
+{
+	int config, config_new;
 
-	if (tb[DATA_RELEASE_DELAY])
-		data->release_delay = blobmsg_get_u32(tb[DATA_RELEASE_DELAY]);
+	config_new = blobmsg_get_u32(tb[DATA_CONFIG]);
+	if (!data->ops->get_configuration(data, &config) &&
+	    config == config_new)
+		return;
 
-	if (tb[DATA_RESPONSE])
-		data->need_response = blobmsg_get_bool(tb[DATA_RESPONSE]);
+	data->ops->set_configuration(data, 0);
+	data->config_start = usbmode_time_ms();
+	switch_delay(data, CONFIG_DELAY, set_config);
+}
 
-	if (t_class > 0 && data->dev_class != t_class)
-		return;
+static int switch_mode(struct usbdev_data *data, struct blob_attr **tb)
+{
+	int mode = MODE_GENERIC;
+	int ret;
 
 	if (tb[DATA_MODE]) {
 		const char *modestr;
@@ -514,22 +1066,189 @@ void handle_switch(struct usbdev_data *data)
 		}
 	}
 
-	modeswitch_cb[mode].cb(data, tb);
+	if (!modeswitch_cb[mode].cb) {
+		fprintf(stderr, "Device %s: %s mode not supported by this build\n",
+			data->idstr, modeswitch_cb[mode].name);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	ret = modeswitch_cb[mode].cb(data, tb);
+	if (ret)
+		fprintf(stderr, "Device %s: %s mode switch failed\n",
+			data->idstr, modeswitch_cb[mode].name);
+
+	return ret;
+}
+
+/*
+ * Advance the switch of a device until it either has to wait for a timer
+ * or all steps are done. Waiting devices are resumed from the uloop.
+ */
+static void switch_run(struct usbdev_data *data)
+{
+	struct blob_attr *tb[__DATA_MAX];
+	bool reset;
+
+	switch_parse(data, tb);
 
-	if (tb[DATA_CONFIG]) {
-		int config, config_new;
+	while (!data->timeout.pending) {
+		if (data->state > SWITCH_MODE && data->ret == LIBUSB_ERROR_NO_DEVICE)
+			data->state = SWITCH_DONE;
+
+		if (data->expired && data->state < SWITCH_DONE) {
+			data->ret = LIBUSB_ERROR_TIMEOUT;
+			data->state = SWITCH_DONE;
+		}
 
-		config_new = blobmsg_get_u32(tb[DATA_CONFIG]);
-		if (libusb_get_configuration(data->devh, &config) ||
-		    config != config_new) {
-			libusb_set_configuration(data->devh, 0);
-			usleep(100000);
-			libusb_set_configuration(data->devh, config_new);
+		switch (data->state++) {
+		case SWITCH_WAIT:
+			if (tb[DATA_WAIT])
+				switch_delay(data, blobmsg_get_u32(tb[DATA_WAIT]) * 1000, NULL);
+			break;
+		case SWITCH_MODE:
+			data->ret = switch_mode(data, tb);
+			break;
+		case SWITCH_CONFIG:
+			if (tb[DATA_CONFIG])
+				switch_config(data, tb);
+			break;
+		case SWITCH_ALT:
+			if (tb[DATA_ALT])
+				set_alt_setting(data, blobmsg_get_u32(tb[DATA_ALT]));
+			break;
+		case SWITCH_RESET:
+			reset = tb[DATA_RESET] && blobmsg_get_bool(tb[DATA_RESET]);
+			/* a mode that is not available is no device fault */
+			if (reset || (data->ret && data->ret != LIBUSB_ERROR_NOT_SUPPORTED &&
+				      data->ctx->reset_on_error))
+				reset_device(data);
+			break;
+		default:
+			uloop_timeout_cancel(&data->deadline_timer);
+			data->done(data);
+			return;
 		}
 	}
+}
+
+static void switch_timeout_cb(struct uloop_timeout *t)
+{
+	struct usbdev_data *data = container_of(t, struct usbdev_data, timeout);
+	switch_cb_t resume = data->resume;
+
+	data->resume = NULL;
+	if (resume)
+		resume(data);
+
+	switch_run(data);
+}
+
+static void switch_deadline_cb(struct uloop_timeout *t)
+{
+	struct usbdev_data *data = container_of(t, struct usbdev_data, deadline_timer);
+
+	switch_expire(data);
+}
+
+/*
+ * The budget of a device is the one from its config entry (or -t), cut
+ * short by the budget of the whole run (-T), counted from the first switch.
+ */
+static void switch_set_deadline(struct usbdev_data *data, struct blob_attr **tb)
+{
+	struct usbmode_ctx *ctx = data->ctx;
+	int64_t now = usbmode_time_ms();
+	int budget = ctx->device_budget;
+
+	if (tb[DATA_DEADLINE])
+		budget = blobmsg_get_u32(tb[DATA_DEADLINE]);
+
+	if (budget > 0)
+		data->deadline = now + budget * 1000;
+
+	if (ctx->run_budget > 0) {
+		if (!ctx->run_deadline)
+			ctx->run_deadline = now + ctx->run_budget * 1000;
+
+		if (!data->deadline || ctx->run_deadline < data->deadline)
+			data->deadline = ctx->run_deadline;
+	}
+
+	if (!data->deadline)
+		return;
 
-	if (tb[DATA_ALT]) {
-		int new = blobmsg_get_u32(tb[DATA_ALT]);
-		set_alt_setting(data, new);
+	if (data->deadline <= now) {
+		switch_expire(data);
+		return;
 	}
+
+	data->deadline_timer.cb = switch_deadline_cb;
+	uloop_timeout_set(&data->deadline_timer, data->deadline - now);
+}
+
+/* switching order of a device, higher first (default 0) */
+int usbmode_switch_priority(struct usbdev_data *data)
+{
+	struct blob_attr *tb[__DATA_MAX];
+
+	switch_parse(data, tb);
+	if (!tb[DATA_PRIORITY])
+		return 0;
+
+	return blobmsg_get_u32(tb[DATA_PRIORITY]);
+}
+
+/* let the run budget count from the next switch on */
+void usbmode_reset_budget(struct usbmode_ctx *ctx)
+{
+	ctx->run_deadline = 0;
+}
+
+void usbmode_handle_switch(struct usbdev_data *data)
+{
+	const struct usbdev_iface *iface = NULL;
+	struct blob_attr *tb[__DATA_MAX];
+	int t_class = 0;
+
+	switch_parse(data, tb);
+
+	if (tb[DATA_DEV_CLASS])
+		t_class = blobmsg_get_u32(tb[DATA_DEV_CLASS]);
+
+	if (tb[DATA_INTERFACE]) {
+		data->interface = blobmsg_get_u32(tb[DATA_INTERFACE]);
+
+		/* endpoints of the chosen interface in the first configuration */
+		if (data->n_ifaces)
+			iface = usbmode_dev_find_iface(data, data->ifaces[0].config_value,
+						       data->interface, 0, -1, -1);
+		/* keep the defaults if it has no bulk endpoints */
+		if (iface && iface->ep_out)
+			data->msg_endpoint = iface->ep_out;
+		if (iface && iface->ep_in)
+			data->response_endpoint = iface->ep_in;
+	}
+
+	if (tb[DATA_MSG_EP])
+		data->msg_endpoint = blobmsg_get_u32(tb[DATA_MSG_EP]);
+
+	if (tb[DATA_RES_EP])
+		data->response_endpoint = blobmsg_get_u32(tb[DATA_RES_EP]);
+
+	if (tb[DATA_RELEASE_DELAY])
+		data->release_delay = blobmsg_get_u32(tb[DATA_RELEASE_DELAY]);
+
+	if (tb[DATA_RESPONSE])
+		data->need_response = blobmsg_get_bool(tb[DATA_RESPONSE]);
+
+	if (t_class > 0 && data->dev_class != t_class) {
+		data->done(data);
+		return;
+	}
+
+	switch_set_deadline(data, tb);
+
+	data->timeout.cb = switch_timeout_cb;
+	data->state = SWITCH_WAIT;
+	switch_run(data);
 }
@@ -3,30 +3,195 @@
 #define __USBMODE_SWITCH_H
 
 #include <libubox/blobmsg.h>
+#include <libubox/avl.h>
+#include <libubox/uloop.h>
 #include <libusb.h>
 
+struct usbdev_data;
+
+typedef void (*switch_cb_t)(struct usbdev_data *data);
+
+struct usbdev_xfer;
+
+typedef void (*xfer_cb_t)(struct usbdev_xfer *xfer);
+
+/*
+ * Asynchronous interrupt transfer. It completes from the uloop with status
+ * set to 0 or a LIBUSB_ERROR_* code (LIBUSB_ERROR_INTERRUPTED if it was
+ * cancelled). The same transfer can be submitted again after completion.
+ */
+struct usbdev_xfer {
+	struct usbdev_data *data;
+	xfer_cb_t cb;
+	void *priv;
+
+	int ep;
+	unsigned char *buf;
+	int len;
+
+	int status;
+	int actual;
+};
+
+/*
+ * Device access used by the switch code. Return values follow the libusb
+ * conventions (LIBUSB_ERROR_* codes) regardless of the backend.
+ */
+struct usbdev_ops {
+	void (*close)(struct usbdev_data *data);
+	int (*reopen)(struct usbdev_data *data);
+	int (*get_string)(struct usbdev_data *data, int idx, char *buf, int len);
+	int (*get_port_path)(struct usbdev_data *data, char *buf, int len);
+
+	int (*get_config_descriptor)(struct usbdev_data *data, int idx,
+				     struct libusb_config_descriptor **config);
+	void (*free_config_descriptor)(struct libusb_config_descriptor *config);
+
+	int (*claim_interface)(struct usbdev_data *data, int iface);
+	int (*release_interface)(struct usbdev_data *data, int iface);
+	int (*detach_kernel_driver)(struct usbdev_data *data, int iface);
+	int (*clear_halt)(struct usbdev_data *data, int ep);
+	int (*get_configuration)(struct usbdev_data *data, int *config);
+	int (*set_configuration)(struct usbdev_data *data, int config);
+	int (*set_alt_setting)(struct usbdev_data *data, int iface, int alt);
+
+	int (*control_transfer)(struct usbdev_data *data, uint8_t type, uint8_t req,
+				uint16_t val, uint16_t idx, unsigned char *buf,
+				uint16_t len, unsigned int timeout);
+	int (*bulk_transfer)(struct usbdev_data *data, int ep, unsigned char *buf,
+			     int len, int *transferred, unsigned int timeout);
+
+	int (*submit_interrupt)(struct usbdev_xfer *xfer);
+	void (*cancel_transfer)(struct usbdev_xfer *xfer);
+	void (*free_transfer)(struct usbdev_xfer *xfer);
+
+	int (*reset)(struct usbdev_data *data);
+	int (*find_reenumerated)(struct usbdev_data *data, uint16_t *vid, uint16_t *pid);
+};
+
+/*
+ * One entry per alt setting of every interface in every configuration,
+ * in descriptor order. ep_out/ep_in hold the first bulk endpoint pair.
+ */
+struct usbdev_iface {
+	uint8_t config_idx;
+	uint8_t config_value;
+	uint8_t number;
+	uint8_t alt;
+	uint8_t cls;
+	uint8_t subclass;
+	uint8_t protocol;
+	uint8_t ep_out;
+	uint8_t ep_in;
+};
+
+/*
+ * Config, settings and state shared by all switches of a run, or of a
+ * libusbmode context. usb is only set when devices are accessed through
+ * libusb, pollfds holds its file descriptors while polled.
+ */
+struct usbmode_ctx {
+	struct libusb_context *usb;
+	struct list_head pollfds;
+	bool polled;
+
+	struct avl_tree devices;
+	char **messages;
+	int *message_len;
+	int n_messages;
+
+	bool reset_on_error;
+	int device_budget;
+	int run_budget;
+	int64_t run_deadline;
+
+	/* libusbmode */
+	struct blob_buf conf;
+	bool own_usb;
+	int n_pending;
+};
+
 struct usbdev_data {
+	struct usbmode_ctx *ctx;
+	const struct usbdev_ops *ops;
+	void *priv;
+
 	struct libusb_device_descriptor desc;
-	struct libusb_config_descriptor *config;
 	libusb_device *dev;
 	libusb_device_handle *devh;
+	struct usbdev_iface *ifaces;
+	int n_ifaces;
 	struct blob_attr *info;
+	int claim;
 	int interface;
 	int msg_endpoint;
 	int response_endpoint;
 	int release_delay;
 	int dev_class;
 	bool need_response;
+	bool async;
+
+	struct uloop_timeout timeout;
+	switch_cb_t resume;
+	switch_cb_t done;
+	void *done_priv;
+	int priority;
+	int64_t reset_start;
+	int64_t config_start;
+	int64_t deadline;
+	struct uloop_timeout deadline_timer;
+	bool expired;
+	int state;
+	int ret;
+	void *mode_priv;
 
 	char idstr[10];
 	char mfg[128], prod[128], serial[128];
 };
 
-extern char **messages;
-extern int *message_len;
-extern int n_messages;
-extern struct libusb_context *usb;
+struct device {
+	struct avl_node avl;
+	struct blob_attr *data;
+};
+
+
+extern const struct usbdev_ops usbmode_libusb_ops;
+
+int usbmode_uloop_attach(struct usbmode_ctx *ctx);
+void usbmode_uloop_detach(struct usbmode_ctx *ctx);
+
+#ifdef USBFS
+struct usbdev_data *usbfs_open(struct usbmode_ctx *ctx, const char *path);
+#endif
+
+#define CLAIM_NONE	-1
+#define CLAIM_BUSY	-2
+
+int usbmode_claim_init(void);
+int usbmode_claim_device(const char *path);
+void usbmode_claim_release(int slot);
+
+void usbmode_init_config(struct usbmode_ctx *ctx);
+int usbmode_parse_config(struct usbmode_ctx *ctx, struct blob_attr *attr);
+void usbmode_free_config(struct usbmode_ctx *ctx);
+struct blob_attr *usbmode_find_dev_data(struct usbdev_data *data, struct device *dev);
+
+void usbmode_dev_init(struct usbmode_ctx *ctx);
+void usbmode_dev_cleanup(struct usbmode_ctx *ctx);
+int usbmode_dev_open(struct usbmode_ctx *ctx, libusb_device *usbdev,
+		     struct usbdev_data **ret);
+void usbmode_dev_free(struct usbdev_data *data);
+struct device *usbmode_dev_lookup(struct usbmode_ctx *ctx, struct usbdev_data *data);
+bool usbmode_dev_claim(struct usbdev_data *data);
+void usbmode_dev_unclaim(struct usbdev_data *data);
+bool usbmode_dev_match(struct usbdev_data *data, struct device *dev);
+const struct usbdev_iface *
+usbmode_dev_find_iface(struct usbdev_data *data, int config, int number,
+		       int alt, int cls, int subclass);
 
-void handle_switch(struct usbdev_data *data);
+void usbmode_handle_switch(struct usbdev_data *data);
+void usbmode_reset_budget(struct usbmode_ctx *ctx);
+int usbmode_switch_priority(struct usbdev_data *data);
+int64_t usbmode_time_ms(void);
 
 #endif
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Opening and matching of devices against the config, shared by the
+ * usbmode executable and libusbmode.
+ */
+#include <stdio.h>
+
+#include "switch.h"
+
+static void parse_alt_setting(struct usbdev_iface *entry,
+			      const struct libusb_interface_descriptor *alt)
+{
+	int i;
+
+	entry->number = alt->bInterfaceNumber;
+	entry->alt = alt->bAlternateSetting;
+	entry->cls = alt->bInterfaceClass;
+	entry->subclass = alt->bInterfaceSubClass;
+	entry->protocol = alt->bInterfaceProtocol;
+
+	for (i = 0; i < alt->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep = &alt->endpoint[i];
+		bool out;
+
+		if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) !=
+		    LIBUSB_TRANSFER_TYPE_BULK)
+			continue;
+
+		out = (ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ==
+		      LIBUSB_ENDPOINT_OUT;
+
+		if (!entry->ep_out && out)
+			entry->ep_out = ep->bEndpointAddress;
+		if (!entry->ep_in && !out)
+			entry->ep_in = ep->bEndpointAddress;
+	}
+}
+
+/*
+ * Read every configuration once into data->ifaces, the handlers only look
+ * at that table afterwards. The defaults for the switch come from the
+ * first interface of the first configuration.
+ */
+static void parse_interface_config(struct usbdev_data *data)
+{
+	struct libusb_config_descriptor *config;
+	struct usbdev_iface *ifaces;
+	int c, i, j, n;
+
+	data->interface = -1;
+
+	for (c = 0; c < data->desc.bNumConfigurations; c++) {
+		if (data->ops->get_config_descriptor(data, c, &config))
+			continue;
+
+		for (i = 0, n = data->n_ifaces; i < config->bNumInterfaces; i++)
+			n += config->interface[i].num_altsetting;
+
+		ifaces = realloc(data->ifaces, n * sizeof(*ifaces));
+		if (!ifaces) {
+			data->ops->free_config_descriptor(config);
+			break;
+		}
+
+		data->ifaces = ifaces;
+		for (i = 0; i < config->bNumInterfaces; i++) {
+			const struct libusb_interface *iface = &config->interface[i];
+
+			for (j = 0; j < iface->num_altsetting; j++) {
+				struct usbdev_iface *entry = &data->ifaces[data->n_ifaces++];
+
+				memset(entry, 0, sizeof(*entry));
+				entry->config_idx = c;
+				entry->config_value = config->bConfigurationValue;
+				parse_alt_setting(entry, &iface->altsetting[j]);
+			}
+		}
+
+		data->ops->free_config_descriptor(config);
+	}
+
+	if (!data->n_ifaces || data->ifaces[0].config_idx)
+		return;
+
+	data->interface = data->ifaces[0].number;
+	data->dev_class = data->ifaces[0].cls;
+	data->msg_endpoint = data->ifaces[0].ep_out;
+	data->response_endpoint = data->ifaces[0].ep_in;
+}
+
+/* config is the bConfigurationValue, arguments < 0 match any value */
+const struct usbdev_iface *
+usbmode_dev_find_iface(struct usbdev_data *data, int config, int number,
+		       int alt, int cls, int subclass)
+{
+	const struct usbdev_iface *entry;
+	int i;
+
+	for (i = 0; i < data->n_ifaces; i++) {
+		entry = &data->ifaces[i];
+
+		if ((config < 0 || entry->config_value == config) &&
+		    (number < 0 || entry->number == number) &&
+		    (alt < 0 || entry->alt == alt) &&
+		    (cls < 0 || entry->cls == cls) &&
+		    (subclass < 0 || entry->subclass == subclass))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Drop the claim once the device goes away from under this instance, so
+ * that whoever sees it come back can take it.
+ */
+void usbmode_dev_unclaim(struct usbdev_data *data)
+{
+	usbmode_claim_release(data->claim);
+	data->claim = CLAIM_NONE;
+}
+
+void usbmode_dev_free(struct usbdev_data *data)
+{
+	free(data->ifaces);
+
+	/* only let others at it once it is closed */
+	data->ops->close(data);
+	usbmode_dev_unclaim(data);
+	free(data->priv);
+	free(data);
+}
+
+struct device *usbmode_dev_lookup(struct usbmode_ctx *ctx, struct usbdev_data *data)
+{
+	struct device *dev;
+
+	sprintf(data->idstr, "%04x:%04x", data->desc.idVendor, data->desc.idProduct);
+
+	return avl_find_element(&ctx->devices, data->idstr, dev, avl);
+}
+
+bool usbmode_dev_match(struct usbdev_data *data, struct device *dev)
+{
+	data->ops->get_string(data, data->desc.iManufacturer,
+			      data->mfg, sizeof(data->mfg));
+	data->ops->get_string(data, data->desc.iProduct,
+			      data->prod, sizeof(data->prod));
+	data->ops->get_string(data, data->desc.iSerialNumber,
+			      data->serial, sizeof(data->serial));
+
+	parse_interface_config(data);
+
+	data->info = usbmode_find_dev_data(data, dev);
+	return !!data->info;
+}
+
+bool usbmode_dev_claim(struct usbdev_data *data)
+{
+	char path[32];
+
+	if (data->ops->get_port_path(data, path, sizeof(path)))
+		return true;
+
+	data->claim = usbmode_claim_device(path);
+	if (data->claim != CLAIM_BUSY)
+		return true;
+
+	fprintf(stderr, "Device %s at %s is handled by another instance, skipping\n",
+		data->idstr, path);
+	return false;
+}
+
+/*
+ * Hook libusb (if it is used) into the uloop and map the claim table.
+ * Neither is fatal, the switch goes on without asynchronous transfers or
+ * without coordinating with other instances.
+ */
+void usbmode_dev_init(struct usbmode_ctx *ctx)
+{
+	if (ctx->usb && usbmode_uloop_attach(ctx))
+		fprintf(stderr, "libusb events cannot be polled, asynchronous transfers will not complete\n");
+
+	if (usbmode_claim_init())
+		fprintf(stderr, "Failed to map the device claim table, not coordinating with other instances\n");
+}
+
+void usbmode_dev_cleanup(struct usbmode_ctx *ctx)
+{
+	if (ctx->polled)
+		usbmode_uloop_detach(ctx);
+}
+
+/*
+ * Open a libusb device that has a config entry and is not handled by
+ * another instance. Returns LIBUSB_ERROR_NOT_FOUND if nothing in the
+ * config matches it.
+ */
+int usbmode_dev_open(struct usbmode_ctx *ctx, libusb_device *usbdev,
+		     struct usbdev_data **ret)
+{
+	struct usbdev_data *data;
+	struct device *dev;
+	int err;
+
+	data = calloc(1, sizeof(*data));
+	if (!data)
+		return LIBUSB_ERROR_NO_MEM;
+
+	data->ctx = ctx;
+	data->ops = &usbmode_libusb_ops;
+	data->async = ctx->polled;
+	data->dev = usbdev;
+	data->claim = CLAIM_NONE;
+
+	err = libusb_get_device_descriptor(usbdev, &data->desc);
+	if (err)
+		goto error;
+
+	err = LIBUSB_ERROR_NOT_FOUND;
+	dev = usbmode_dev_lookup(ctx, data);
+	if (!dev)
+		goto error;
+
+	err = LIBUSB_ERROR_BUSY;
+	if (!usbmode_dev_claim(data))
+		goto error;
+
+	err = libusb_open(usbdev, &data->devh);
+	if (err)
+		goto error;
+
+	err = LIBUSB_ERROR_NOT_FOUND;
+	if (!usbmode_dev_match(data, dev))
+		goto error;
+
+	*ret = data;
+	return 0;
+
+error:
+	usbmode_dev_free(data);
+	return err;
+}
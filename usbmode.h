@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * libusbmode: switch USB modems from within a long running process.
+ *
+ * Switching is driven by the uloop of the caller, which has to call
+ * uloop_init() before creating a context. Every context holds its own
+ * config and settings.
+ */
+#ifndef __LIBUSBMODE_H
+#define __LIBUSBMODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libusb.h>
+
+struct usbmode_ctx;
+
+/*
+ * Called once the switch of a device is finished. result is 0 on success
+ * or a LIBUSB_ERROR_* code, e.g. LIBUSB_ERROR_TIMEOUT if the time budget
+ * ran out.
+ */
+typedef void (*usbmode_cb_t)(struct usbmode_ctx *ctx, libusb_device *dev,
+			     int result, void *priv);
+
+/*
+ * usb may be NULL to let the context create its own libusb context. A
+ * libusb context passed in here has its events dispatched from the uloop
+ * from then on: the context takes over its pollfd notifiers and clears
+ * them again in usbmode_free(). It must not be shared with another
+ * usbmode context, or polled for events elsewhere.
+ */
+struct usbmode_ctx *usbmode_new(libusb_context *usb);
+
+/*
+ * Only possible once no switch is pending anymore, returns
+ * LIBUSB_ERROR_BUSY (and keeps the context) otherwise.
+ */
+int usbmode_free(struct usbmode_ctx *ctx);
+
+/* replace the current config, only while no switch is pending */
+int usbmode_load_config(struct usbmode_ctx *ctx, const char *file);
+
+void usbmode_set_reset_on_error(struct usbmode_ctx *ctx, bool reset);
+/* time budgets in seconds, 0 for no limit; the run budget restarts here */
+void usbmode_set_budget(struct usbmode_ctx *ctx, int device_secs, int run_secs);
+
+/*
+ * Check whether the config has an entry for a device. The strings may be
+ * NULL if they are not known.
+ */
+bool usbmode_match(struct usbmode_ctx *ctx, uint16_t vid, uint16_t pid,
+		   const char *mfg, const char *prod, const char *serial);
+
+/*
+ * Start switching dev, cb reports the outcome (possibly before this
+ * returns, if there is nothing to wait for). Returns 0 if the switch was
+ * started, LIBUSB_ERROR_NOT_FOUND if the config does not cover the device
+ * or LIBUSB_ERROR_BUSY if another usbmode instance is handling it.
+ */
+int usbmode_switch(struct usbmode_ctx *ctx, libusb_device *dev,
+		   usbmode_cb_t cb, void *priv);
+
+/* number of switches that have not finished yet */
+int usbmode_pending(struct usbmode_ctx *ctx);
+
+#endif